@@ -0,0 +1,261 @@
+/* Checks 'spm proxy' without a space mouse: feeds a fake SpaceNavigator
+ * created with uinput, reads the proxy's virtual device and reports whether
+ * motion and buttons arrive, and the latency from the fake device to the
+ * proxy device.
+ *
+ * usage: proxy_check [SPM [FRAMES]]
+ * needs write access to /dev/uinput and read access to /dev/input/event*,
+ * build with 'make check' in the top directory
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+/* the ids of a SpaceNavigator, for libspacemouse to list the fake device */
+#define VENDOR_ID 0x046d
+#define PRODUCT_ID 0xc626
+#define NAME "3Dconnexion SpaceNavigator"
+
+#define PROXY_PREFIX "spm proxy "
+#define TIMEOUT_MS 3000
+
+static int const axis_codes[6] = {
+  REL_X, REL_Y, REL_Z, REL_RX, REL_RY, REL_RZ
+};
+
+static long long
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+fail(char const *msg)
+{
+  fprintf(stderr, "proxy_check: %s: %s\n", msg, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+static int
+fake_create(char *devnode, size_t size)
+{
+  struct uinput_setup setup = { .id = { BUS_USB, VENDOR_ID, PRODUCT_ID, 1 },
+                                .name = NAME };
+  char sysname[64], path[128];
+  struct dirent *entry;
+  DIR *dir;
+  int fd, err = 0;
+
+  if ((fd = open("/dev/uinput", O_WRONLY)) == -1)
+    fail("failed to open /dev/uinput");
+
+  err |= ioctl(fd, UI_SET_EVBIT, EV_REL);
+  for (int idx = 0; idx < 6; idx++)
+    err |= ioctl(fd, UI_SET_RELBIT, axis_codes[idx]);
+
+  err |= ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  err |= ioctl(fd, UI_SET_KEYBIT, BTN_0);
+  err |= ioctl(fd, UI_SET_KEYBIT, BTN_1);
+
+  err |= ioctl(fd, UI_SET_EVBIT, EV_LED);
+  err |= ioctl(fd, UI_SET_LEDBIT, LED_MISC);
+
+  if (err || ioctl(fd, UI_DEV_SETUP, &setup) == -1 ||
+      ioctl(fd, UI_DEV_CREATE) == -1 ||
+      ioctl(fd, UI_GET_SYSNAME(sizeof sysname), sysname) == -1)
+    fail("failed to create the fake device");
+
+  /* the event node is a child of the input device in sysfs */
+  snprintf(path, sizeof path, "/sys/devices/virtual/input/%s", sysname);
+  if ((dir = opendir(path)) == NULL)
+    fail("failed to find the fake device's node");
+
+  devnode[0] = '\0';
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) == 0)
+      snprintf(devnode, size, "/dev/input/%s", entry->d_name);
+  }
+  closedir(dir);
+
+  if (devnode[0] == '\0') {
+    errno = ENOENT;
+    fail("failed to find the fake device's node");
+  }
+
+  return fd;
+}
+
+static void
+fake_send(int fd, int type, int code, int value)
+{
+  struct input_event events[] = {
+    { .type = type, .code = code, .value = value },
+    { .type = EV_SYN, .code = SYN_REPORT }
+  };
+
+  if (write(fd, events, sizeof events) != sizeof events)
+    fail("failed to write to the fake device");
+}
+
+/* opens the virtual device of the proxy once it appeared */
+static int
+proxy_open(void)
+{
+  long long deadline = now_us() + TIMEOUT_MS * 1000LL;
+
+  do {
+    DIR *dir = opendir("/dev/input");
+    struct dirent *entry;
+
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+      char path[288], name[256] = "";
+      int fd;
+
+      if (strncmp(entry->d_name, "event", 5) != 0)
+        continue;
+
+      snprintf(path, sizeof path, "/dev/input/%s", entry->d_name);
+      if ((fd = open(path, O_RDONLY | O_NONBLOCK)) == -1)
+        continue;
+
+      if (ioctl(fd, EVIOCGNAME(sizeof name), name) >= 0 &&
+          strncmp(name, PROXY_PREFIX, strlen(PROXY_PREFIX)) == 0) {
+        closedir(dir);
+        return fd;
+      }
+
+      close(fd);
+    }
+
+    if (dir != NULL)
+      closedir(dir);
+
+    nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+  } while (now_us() < deadline);
+
+  return -1;
+}
+
+/* Waits for an event of the proxy, returns the microseconds it took from
+ * sent or -1 if it did not arrive.
+ */
+static long long
+proxy_wait(int fd, int type, int code, int value, long long sent)
+{
+  long long deadline = sent + TIMEOUT_MS * 1000LL;
+
+  while (true) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct input_event event;
+    long long left = deadline - now_us();
+
+    if (left <= 0 || poll(&pfd, 1, left / 1000 + 1) < 1)
+      return -1;
+
+    while (read(fd, &event, sizeof event) == sizeof event) {
+      if (event.type == type && event.code == code && event.value == value)
+        return now_us() - sent;
+    }
+  }
+}
+
+static int
+compare(void const *a, void const *b)
+{
+  long long x = *(long long const *)a, y = *(long long const *)b;
+
+  return (x > y) - (x < y);
+}
+
+int
+main(int argc, char **argv)
+{
+  char const *spm = argc > 1 ? argv[1] : "spm";
+  int frames = argc > 2 ? atoi(argv[2]) : 1000;
+  char devnode[64], pattern[72];
+  long long *latencies;
+  int fake_fd, proxy_fd, received = 0, status = EXIT_SUCCESS;
+  pid_t pid;
+
+  if (frames < 1 || (latencies = malloc(frames * sizeof *latencies)) == NULL) {
+    fprintf(stderr, "usage: proxy_check [SPM [FRAMES]]\n");
+    return EXIT_FAILURE;
+  }
+
+  fake_fd = fake_create(devnode, sizeof devnode);
+  snprintf(pattern, sizeof pattern, "^%s$", devnode);
+
+  if ((pid = fork()) == -1) {
+    fail("failed to start spm");
+  } else if (pid == 0) {
+    execlp(spm, spm, "proxy", "--devnode", pattern, (char *)NULL);
+    _exit(127);
+  }
+
+  if ((proxy_fd = proxy_open()) == -1) {
+    fprintf(stderr, "proxy_check: no proxy device for %s within %d ms, does "
+            "libspacemouse list the fake device?\n", devnode, TIMEOUT_MS);
+    status = EXIT_FAILURE;
+    goto out;
+  }
+
+  /* distinct values, so every frame is matched with its own copy */
+  for (int idx = 0; idx < frames; idx++) {
+    int value = (idx % 2 ? -1 : 1) * (100 + idx % 256);
+    long long sent = now_us(), latency;
+
+    fake_send(fake_fd, EV_REL, REL_X, value);
+
+    if ((latency = proxy_wait(proxy_fd, EV_REL, REL_X, value, sent)) != -1)
+      latencies[received++] = latency;
+  }
+
+  fake_send(fake_fd, EV_KEY, BTN_0, 1);
+  if (proxy_wait(proxy_fd, EV_KEY, BTN_0, 1, now_us()) == -1) {
+    fprintf(stderr, "proxy_check: button press did not arrive\n");
+    status = EXIT_FAILURE;
+  }
+  fake_send(fake_fd, EV_KEY, BTN_0, 0);
+
+  printf("%s: %d of %d motion frames arrived\n", devnode, received, frames);
+  if (received < frames)
+    status = EXIT_FAILURE;
+
+  if (received > 0) {
+    qsort(latencies, received, sizeof *latencies, compare);
+    printf("latency fake device to proxy device: min %lld us, median %lld us, "
+           "p99 %lld us, max %lld us\n", latencies[0],
+           latencies[received / 2], latencies[received * 99 / 100],
+           latencies[received - 1]);
+  }
+
+  close(proxy_fd);
+
+out:
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+
+  ioctl(fake_fd, UI_DEV_DESTROY);
+  close(fake_fd);
+  free(latencies);
+
+  return status;
+}
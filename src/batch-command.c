@@ -0,0 +1,634 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <regex.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libspacemouse.h>
+
+#include "options.h"
+#include "util.h"
+
+#include "commands.h"
+
+#define MAX_CLIENTS 16
+#define MAX_LINE 4096
+#define MAX_ARGS 16
+/* number of distinct match option sets whose regexes are kept compiled */
+#define MATCH_CACHE_SIZE 16
+
+/* compiled regexes of one set of match options */
+struct match_cache_entry {
+  bool used, ignore_case;
+  char *re_strs[3];
+  regex_t regex[3];
+
+  unsigned long last_use;
+};
+
+/* per opened device, which cache entries are known to (not) match it */
+struct device_state {
+  unsigned known, matched;
+};
+
+struct client {
+  int in_fd, out_fd;
+
+  char buf[MAX_LINE];
+  size_t len;
+};
+
+struct response {
+  char const *progname;
+  unsigned long seq;
+
+  char *buf;
+  size_t len, size;
+};
+
+struct batch {
+  char const *progname;
+  match_t const *match;
+
+  struct match_cache_entry cache[MATCH_CACHE_SIZE];
+  unsigned long cache_clock;
+
+  struct client clients[MAX_CLIENTS];
+  size_t nclients;
+
+  unsigned long seq;
+
+  /* statistics */
+  struct timespec start;
+  unsigned long commands, errors, cache_hits, cache_misses, match_hits,
+                hotplugs;
+};
+
+static void
+respond(struct response *resp, char const *format, ...)
+{
+  va_list ap;
+  int len;
+
+  while (true) {
+    size_t left = resp->size - resp->len;
+
+    va_start(ap, format);
+    len = snprintf(resp->buf + resp->len, left, "%lu ", resp->seq);
+    if (len >= 0 && (size_t)len < left)
+      len += vsnprintf(resp->buf + resp->len + len, left - len, format, ap);
+    va_end(ap);
+
+    if (len >= 0 && (size_t)len < left)
+      break;
+
+    resp->size = resp->size * 2 + (len > 0 ? len : 0) + 1;
+    if ((resp->buf = realloc(resp->buf, resp->size)) == NULL)
+      fail("%s: failed to allocate memory: %s\n", resp->progname,
+           strerror(errno));
+  }
+
+  resp->len += len;
+}
+
+static bool
+str_eq(char const *a, char const *b)
+{
+  return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static void
+cache_entry_free(struct match_cache_entry *entry)
+{
+  for (size_t idx = 0; idx < 3; idx++) {
+    if (entry->re_strs[idx] != NULL) {
+      regfree(&entry->regex[idx]);
+      free(entry->re_strs[idx]);
+      entry->re_strs[idx] = NULL;
+    }
+  }
+
+  entry->used = false;
+}
+
+/* Returns the cache index for the match options, compiling them on a miss.
+ * Returns -1 if a regex is not a valid ERE.
+ */
+static int
+cache_lookup(struct batch *batch, match_t const *match)
+{
+  char const *re_strs[] = { match->device, match->manufacturer,
+                            match->product };
+  int cflags = REG_EXTENDED | REG_NOSUB | (match->ignore_case ? REG_ICASE : 0);
+  struct match_cache_entry *entry = NULL;
+  struct spacemouse *head, *iter;
+  size_t slot = 0;
+
+  for (size_t idx = 0; idx < MATCH_CACHE_SIZE; idx++) {
+    struct match_cache_entry *cur = &batch->cache[idx];
+
+    if (cur->used && cur->ignore_case == match->ignore_case &&
+        str_eq(cur->re_strs[0], re_strs[0]) &&
+        str_eq(cur->re_strs[1], re_strs[1]) &&
+        str_eq(cur->re_strs[2], re_strs[2])) {
+      batch->cache_hits++;
+      cur->last_use = ++batch->cache_clock;
+      return idx;
+    }
+
+    /* prefer unused slots, then the least recently used one */
+    if (entry == NULL || (entry->used && (!cur->used ||
+                                          cur->last_use < entry->last_use))) {
+      entry = cur;
+      slot = idx;
+    }
+  }
+
+  batch->cache_misses++;
+
+  /* forget the cached device matches of the evicted entry */
+  if (entry->used) {
+    cache_entry_free(entry);
+
+    if (spacemouse_device_list(&head, 0) == 0) {
+      spacemouse_device_list_foreach(iter, head) {
+        struct device_state *state = spacemouse_device_get_data(iter);
+
+        if (state != NULL)
+          state->known &= ~(1u << slot);
+      }
+    }
+  }
+
+  for (size_t idx = 0; idx < 3; idx++) {
+    if (re_strs[idx] == NULL)
+      continue;
+
+    if (regcomp(&entry->regex[idx], re_strs[idx], cflags) != 0 ||
+        (entry->re_strs[idx] = strdup(re_strs[idx])) == NULL) {
+      cache_entry_free(entry);
+      return -1;
+    }
+  }
+
+  entry->used = true;
+  entry->ignore_case = match->ignore_case;
+  entry->last_use = ++batch->cache_clock;
+
+  return slot;
+}
+
+static bool
+device_matches(struct batch *batch, struct spacemouse *mouse, int slot)
+{
+  struct device_state *state = spacemouse_device_get_data(mouse);
+  struct match_cache_entry *entry = &batch->cache[slot];
+  char const *members[] = { spacemouse_device_get_devnode(mouse),
+                            spacemouse_device_get_manufacturer(mouse),
+                            spacemouse_device_get_product(mouse) };
+  bool match = true;
+
+  if (state->known & 1u << slot) {
+    batch->match_hits++;
+    return state->matched & 1u << slot;
+  }
+
+  for (size_t idx = 0; match && idx < 3; idx++) {
+    if (entry->re_strs[idx] != NULL &&
+        regexec(&entry->regex[idx], members[idx], 0, NULL, 0) != 0)
+      match = false;
+  }
+
+  state->known |= 1u << slot;
+  if (match)
+    state->matched |= 1u << slot;
+  else
+    state->matched &= ~(1u << slot);
+
+  return match;
+}
+
+/* opens a device matching the batch command's options and keeps it open */
+static void
+device_init(struct batch *batch, struct spacemouse *mouse)
+{
+  struct device_state *state;
+  int err, match = match_device(mouse, batch->match);
+
+  if (match == -1)
+    fail("%s: failed to use regex, please use valid ERE\n", batch->progname);
+  else if (!match)
+    return;
+
+  if ((err = spacemouse_device_open(mouse)) < 0) {
+    warn("%s: failed to open device '%s': %s\n", batch->progname,
+         spacemouse_device_get_devnode(mouse), strerror(-err));
+    return;
+  }
+
+  if ((state = calloc(1, sizeof *state)) == NULL)
+    fail("%s: failed to allocate memory: %s\n", batch->progname,
+         strerror(errno));
+
+  spacemouse_device_set_data(mouse, state);
+}
+
+static void
+device_close(struct spacemouse *mouse)
+{
+  free(spacemouse_device_get_data(mouse));
+  spacemouse_device_set_data(mouse, NULL);
+
+  spacemouse_device_close(mouse);
+}
+
+/* Parses a command line like the command line of spm, the command in argv[1].
+ * Returns the index of the first non-option argument, or -1 after
+ * responding with the error.
+ */
+static int
+parse_line(struct batch *batch, struct response *resp, cmd_t cmd, int argc,
+           char **argv, options_t *options, action_t *action)
+{
+  char error[256];
+  size_t prefix = strlen(batch->progname);
+  jmp_buf env;
+  int consumed = -1;
+
+  init_options(*options);
+
+  /* the parsers fail() on errors, which jumps back here */
+  opterr = 0;
+  fail_catch(&env, error, sizeof error);
+
+  if (setjmp(env) == 0) {
+    consumed = parse_options(argc, argv, options, cmd);
+
+    /* the batch serves one line at a time, --sync implies --parallel */
+    if (action != NULL && options->parallel != 0)
+      fail("%s: options '-p'/'--parallel' and '--sync' are not available in "
+           "batch\n", batch->progname);
+    else if (action != NULL)
+      *action = parse_led_arguments(batch->progname, argc - consumed,
+                                    argv + consumed);
+    else if (consumed != argc)
+      fail("%s: invalid non-option argument(s)\n", batch->progname);
+    else if (options->watch)
+      fail("%s: option '-w'/'--watch' is not available in batch\n",
+           batch->progname);
+  } else {
+    /* 'spm: message\n' becomes 'error: message\n' */
+    if (strncmp(error, batch->progname, prefix) == 0 &&
+        strncmp(error + prefix, ": ", 2) == 0)
+      prefix += 2;
+    else
+      prefix = 0;
+
+    respond(resp, "error: %s", error + prefix);
+    consumed = -1;
+  }
+
+  fail_catch(NULL, NULL, 0);
+  opterr = 1;
+
+  return consumed;
+}
+
+static void
+led_cmd(struct batch *batch, struct response *resp, int argc, char **argv)
+{
+  struct spacemouse *head, *iter;
+  options_t options;
+  action_t action;
+  bool matched = false;
+  int slot;
+
+  if (parse_line(batch, resp, LED_CMD, argc, argv, &options, &action) == -1)
+    return;
+
+  if ((slot = cache_lookup(batch, &options.match)) == -1) {
+    respond(resp, "error: failed to use regex, please use valid ERE\n");
+    return;
+  }
+
+  if (spacemouse_device_list(&head, 0) != 0) {
+    respond(resp, "error: failed to list devices\n");
+    return;
+  }
+
+  spacemouse_device_list_foreach(iter, head) {
+    char const *devnode = spacemouse_device_get_devnode(iter);
+    int err, led_state = action == LED_ON;
+
+    if (spacemouse_device_get_data(iter) == NULL ||
+        !device_matches(batch, iter, slot))
+      continue;
+
+    matched = true;
+
+    if ((action == LED_NONE || action == LED_SWITCH) &&
+        (led_state = spacemouse_device_get_led(iter)) < 0) {
+      respond(resp, "error: failed to get led state for '%s': %s\n",
+              devnode, strerror(-led_state));
+      return;
+    }
+
+    if (action == LED_NONE) {
+      respond(resp, "%s: %s\n", devnode, led_state ? "on" : "off");
+      continue;
+    }
+
+    if (action == LED_SWITCH)
+      led_state = !led_state;
+
+    if ((err = spacemouse_device_set_led(iter, led_state)) < 0) {
+      respond(resp, "error: failed to set led state for '%s': %s\n",
+              devnode, strerror(-err));
+      return;
+    }
+
+    if (action == LED_SWITCH)
+      respond(resp, "%s: switched %s\n", devnode, led_state ? "on" : "off");
+  }
+
+  /* like the led command, which fails if there was nothing to change */
+  if (!matched && action != LED_NONE)
+    respond(resp, "error: no matching device\n");
+  else
+    respond(resp, "ok\n");
+}
+
+static void
+list_cmd(struct batch *batch, struct response *resp, int argc, char **argv)
+{
+  struct spacemouse *head, *iter;
+  options_t options;
+  int slot;
+
+  if (parse_line(batch, resp, LIST_CMD, argc, argv, &options, NULL) == -1)
+    return;
+
+  if ((slot = cache_lookup(batch, &options.match)) == -1) {
+    respond(resp, "error: failed to use regex, please use valid ERE\n");
+    return;
+  }
+
+  if (spacemouse_device_list(&head, 0) != 0) {
+    respond(resp, "error: failed to list devices\n");
+    return;
+  }
+
+  spacemouse_device_list_foreach(iter, head) {
+    if (spacemouse_device_get_data(iter) == NULL ||
+        !device_matches(batch, iter, slot))
+      continue;
+
+    respond(resp, "devnode: %s\n", spacemouse_device_get_devnode(iter));
+    respond(resp, "manufacturer: %s\n",
+            spacemouse_device_get_manufacturer(iter));
+    respond(resp, "product: %s\n", spacemouse_device_get_product(iter));
+  }
+
+  respond(resp, "ok\n");
+}
+
+static void
+stats_cmd(struct batch *batch, struct response *resp, int argc)
+{
+  struct spacemouse *head, *iter;
+  struct timespec now;
+  size_t ndevices = 0;
+
+  if (argc > 2) {
+    respond(resp, "error: the stats command takes no arguments\n");
+    return;
+  }
+
+  if (spacemouse_device_list(&head, 0) == 0) {
+    spacemouse_device_list_foreach(iter, head) {
+      if (spacemouse_device_get_data(iter) != NULL)
+        ndevices++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  respond(resp, "uptime: %ld s\n", (long)(now.tv_sec - batch->start.tv_sec));
+  respond(resp, "commands: %lu\n", batch->commands);
+  respond(resp, "errors: %lu\n", batch->errors);
+  respond(resp, "devices: %zu\n", ndevices);
+  respond(resp, "hotplugs: %lu\n", batch->hotplugs);
+  respond(resp, "regex cache: %lu hits, %lu misses\n", batch->cache_hits,
+          batch->cache_misses);
+  respond(resp, "cached matches: %lu\n", batch->match_hits);
+  respond(resp, "ok\n");
+}
+
+static void
+run_command(struct batch *batch, struct client *client, char *line)
+{
+  struct response resp = { batch->progname, ++batch->seq, NULL, 0, 0 };
+  /* shaped like main()'s argv, for the option parser */
+  char *argv[MAX_ARGS + 2] = { (char *)batch->progname }, *save;
+  int argc = 1;
+
+  for (char *tok = strtok_r(line, " \t\r", &save); tok != NULL;
+       tok = strtok_r(NULL, " \t\r", &save)) {
+    if (argc == MAX_ARGS + 1) {
+      argc = -1;
+      break;
+    }
+    argv[argc++] = tok;
+  }
+
+  if (argc == 1) {
+    batch->seq--; /* ignore empty lines */
+    return;
+  }
+
+  batch->commands++;
+
+  if (argc == -1)
+    respond(&resp, "error: too many arguments\n");
+  else if (strcmp(argv[1], "led") == 0)
+    led_cmd(batch, &resp, argc, argv);
+  else if (strcmp(argv[1], "list") == 0 || strcmp(argv[1], "ls") == 0)
+    list_cmd(batch, &resp, argc, argv);
+  else if (strcmp(argv[1], "stats") == 0)
+    stats_cmd(batch, &resp, argc);
+  else
+    respond(&resp, "error: unknown command '%s'\n", argv[1]);
+
+  /* every response ends in either 'ok' or an error line */
+  if (resp.len < 3 || strcmp(resp.buf + resp.len - 3, "ok\n") != 0)
+    batch->errors++;
+
+  for (size_t written = 0; written < resp.len;) {
+    ssize_t ret = write(client->out_fd, resp.buf + written,
+                        resp.len - written);
+
+    if (ret == -1 && errno == EINTR)
+      continue;
+    else if (ret == -1)
+      break;
+
+    written += ret;
+  }
+
+  free(resp.buf);
+}
+
+/* returns false when the client is gone */
+static bool
+client_read(struct batch *batch, struct client *client)
+{
+  ssize_t ret = read(client->in_fd, client->buf + client->len,
+                     MAX_LINE - client->len);
+  char *start = client->buf, *end;
+
+  if (ret == -1 && errno == EINTR)
+    return true;
+  else if (ret < 1)
+    return false;
+
+  client->len += ret;
+
+  while ((end = memchr(start, '\n', client->buf + client->len - start))) {
+    *end = '\0';
+    run_command(batch, client, start);
+    start = end + 1;
+  }
+
+  client->len -= start - client->buf;
+  memmove(client->buf, start, client->len);
+
+  /* line too long, drop it */
+  if (client->len == MAX_LINE)
+    client->len = 0;
+
+  return true;
+}
+
+static void
+client_add(struct batch *batch, int in_fd, int out_fd)
+{
+  if (batch->nclients == MAX_CLIENTS) {
+    close(in_fd);
+    return;
+  }
+
+  batch->clients[batch->nclients++] = (struct client){ in_fd, out_fd };
+}
+
+static int
+listen_socket(char const *progname, char const *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  if (strlen(path) >= sizeof addr.sun_path)
+    fail("%s: socket path '%s' is too long\n", progname, path);
+
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+      listen(fd, MAX_CLIENTS) == -1)
+    fail("%s: failed to listen on '%s': %s\n", progname, path,
+         strerror(errno));
+
+  return fd;
+}
+
+int
+batch_command(char const *progname, options_t *options, int nargs, char **args)
+{
+  struct batch batch = { .progname = progname, .match = &options->match };
+  struct spacemouse *head, *iter;
+  int err, listen_fd = -1, monitor_fd;
+
+  if (nargs)
+    fail("%s: invalid non-command or non-option argument(s), use the "
+         "'-h'/'--help' option to display the help message\n", progname);
+
+  clock_gettime(CLOCK_MONOTONIC, &batch.start);
+
+  /* a client closing its socket early must not kill the session */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((monitor_fd = spacemouse_monitor_open()) < 0)
+    fail("%s: failed to open device monitor: %s\n", progname,
+         strerror(-monitor_fd));
+
+  if ((err = spacemouse_device_list(&head, 1)) != 0)
+    fail("%s: failed to list devices: %s\n", progname, strerror(-err));
+
+  spacemouse_device_list_foreach(iter, head)
+    device_init(&batch, iter);
+
+  if (options->socket != NULL)
+    listen_fd = listen_socket(progname, options->socket);
+  else
+    client_add(&batch, STDIN_FILENO, STDOUT_FILENO);
+
+  while (listen_fd != -1 || batch.nclients > 0) {
+    struct pollfd fds[MAX_CLIENTS + 2];
+    size_t nfds = 0;
+
+    fds[nfds++] = (struct pollfd){ monitor_fd, POLLIN, 0 };
+    fds[nfds++] = (struct pollfd){ listen_fd, POLLIN, 0 };
+    for (size_t idx = 0; idx < batch.nclients; idx++)
+      fds[nfds++] = (struct pollfd){ batch.clients[idx].in_fd, POLLIN, 0 };
+
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      fail("%s: poll() error: %s\n", progname, strerror(errno));
+    }
+
+    if (fds[0].revents & POLLIN) {
+      struct spacemouse *mon_mouse;
+      int action = spacemouse_monitor(&mon_mouse);
+
+      if (action == SPACEMOUSE_ACTION_ADD) {
+        batch.hotplugs++;
+        device_init(&batch, mon_mouse);
+      } else if (action == SPACEMOUSE_ACTION_REMOVE &&
+                 spacemouse_device_get_data(mon_mouse) != NULL) {
+        batch.hotplugs++;
+        device_close(mon_mouse);
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int fd = accept(listen_fd, NULL, NULL);
+
+      if (fd != -1)
+        client_add(&batch, fd, fd);
+    }
+
+    /* iterate backwards, so removing a client does not skip one */
+    for (size_t idx = nfds - 2; idx-- > 0;) {
+      if (fds[idx + 2].revents == 0 ||
+          client_read(&batch, &batch.clients[idx]))
+        continue;
+
+      if (batch.clients[idx].in_fd != STDIN_FILENO)
+        close(batch.clients[idx].in_fd);
+
+      batch.clients[idx] = batch.clients[--batch.nclients];
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -6,7 +6,9 @@ typedef enum {
   LIST_CMD,
   LED_CMD,
   EVENT_CMD,
-  RAW_CMD
+  RAW_CMD,
+  PROXY_CMD,
+  BATCH_CMD
 } cmd_t;
 
 #include "options.h"
@@ -24,9 +26,34 @@ event_command(char const *progname, options_t *options, int nargs,
 int
 raw_command(char const *progname, options_t *options, int nargs, char **args);
 
+int
+proxy_command(char const *progname, options_t *options, int nargs,
+              char **args);
+
+int
+batch_command(char const *progname, options_t *options, int nargs,
+              char **args);
+
+/* led command specific */
+
+typedef enum {
+  LED_NONE = 0, /* no command specified, print led state of devices */
+  LED_OFF,
+  LED_ON,
+  LED_SWITCH
+} action_t;
+
+/* parses the on, off or switch argument, abbreviations included */
+action_t
+parse_led_arguments(char const *progname, int nargs, char **args);
+
 /* event command specific */
 
-#define MIN_DEVIATION 256
-#define N_EVENTS 16
+#include "spm.h"
+
+#define MIN_DEVIATION SPM_MIN_DEVIATION
+#define N_EVENTS SPM_N_EVENTS
+#define MIN_REPEAT SPM_MIN_REPEAT
+#define CALIBRATE_EVENTS SPM_CALIBRATE_EVENTS
 
 #endif /* #ifndef _COMMANDS_HDR_ */
@@ -0,0 +1,426 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "stats.h"
+
+#include "coprocess.h"
+
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 30000
+/* a handler which ran at least this long is considered healthy again */
+#define BACKOFF_RESET_MS 10000
+
+#define READ_BUF_SIZE 4096
+/* unwritten messages kept for a slow handler, newer ones are dropped */
+#define MAX_PENDING (64 * 1024)
+/* a handler which takes none of its pending input for this long is hung */
+#define HUNG_MS 5000
+/* time a stopped handler gets to exit on SIGTERM before SIGKILL */
+#define STOP_MS 500
+
+struct coprocess {
+  char const *progname, *command;
+  framing_t framing;
+
+  pid_t pid;
+  int write_fd, read_fd;
+
+  long long started_ms, restart_ms;
+  int backoff_ms;
+
+  char *wbuf;
+  size_t wlen, wsize;
+
+  /* wbuf could not be written completely, since blocked_ms */
+  bool blocked;
+  long long blocked_ms;
+  unsigned long dropped;
+
+  char rbuf[READ_BUF_SIZE + 1];
+  size_t rlen;
+};
+
+static void
+start(struct coprocess *coproc)
+{
+  int to_child[2], from_child[2];
+
+  coproc->started_ms = now_ms();
+
+  if (pipe(to_child) == -1)
+    goto error;
+
+  if (pipe(from_child) == -1) {
+    close(to_child[0]);
+    close(to_child[1]);
+    goto error;
+  }
+
+  /* dup2() clears FD_CLOEXEC of the child's stdin and stdout */
+  for (int idx = 0; idx < 2; idx++) {
+    fcntl(to_child[idx], F_SETFD, FD_CLOEXEC);
+    fcntl(from_child[idx], F_SETFD, FD_CLOEXEC);
+  }
+
+  /* a slow handler must not block the events of the other outputs */
+  fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+
+  if ((coproc->pid = fork()) == -1) {
+    close(to_child[0]);
+    close(to_child[1]);
+    close(from_child[0]);
+    close(from_child[1]);
+    goto error;
+  } else if (coproc->pid == 0) {
+    dup2(to_child[0], STDIN_FILENO);
+    dup2(from_child[1], STDOUT_FILENO);
+    close(to_child[0]);
+    close(to_child[1]);
+    close(from_child[0]);
+    close(from_child[1]);
+
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", coproc->command, (char *)NULL);
+    _exit(127);
+  }
+
+  close(to_child[0]);
+  close(from_child[1]);
+
+  coproc->write_fd = to_child[1];
+  coproc->read_fd = from_child[0];
+  coproc->rlen = 0;
+
+  return;
+
+error:
+  warn("%s: failed to start coprocess '%s': %s\n", coproc->progname,
+       coproc->command, strerror(errno));
+
+  coproc->pid = -1;
+  coproc->restart_ms = now_ms() + coproc->backoff_ms;
+}
+
+static void
+stop(struct coprocess *coproc)
+{
+  if (coproc->pid == -1)
+    return;
+
+  close(coproc->write_fd);
+  if (coproc->read_fd > -1)
+    close(coproc->read_fd);
+  coproc->write_fd = coproc->read_fd = -1;
+
+  /* a handler ignoring SIGTERM must not freeze the event loop */
+  if (waitpid(coproc->pid, NULL, WNOHANG) == 0) {
+    long long deadline = now_ms() + STOP_MS;
+    pid_t ret;
+
+    kill(coproc->pid, SIGTERM);
+
+    while ((ret = waitpid(coproc->pid, NULL, WNOHANG)) == 0 &&
+           now_ms() < deadline)
+      nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+
+    if (ret == 0) {
+      kill(coproc->pid, SIGKILL);
+      waitpid(coproc->pid, NULL, 0);
+    }
+  }
+  coproc->pid = -1;
+  coproc->wlen = 0;
+  coproc->blocked = false;
+  coproc->dropped = 0;
+}
+
+/* stops the handler and schedules its restart */
+static void
+died(struct coprocess *coproc)
+{
+  long long now = now_ms();
+
+  stop(coproc);
+
+  if (now - coproc->started_ms >= BACKOFF_RESET_MS)
+    coproc->backoff_ms = BACKOFF_MIN_MS;
+
+  warn("%s: coprocess '%s' exited, restarting in %d ms\n", coproc->progname,
+       coproc->command, coproc->backoff_ms);
+
+  coproc->restart_ms = now + coproc->backoff_ms;
+
+  coproc->backoff_ms *= 2;
+  if (coproc->backoff_ms > BACKOFF_MAX_MS)
+    coproc->backoff_ms = BACKOFF_MAX_MS;
+}
+
+struct coprocess *
+coprocess_new(char const *progname, char const *command, framing_t framing)
+{
+  struct coprocess *coproc = calloc(1, sizeof *coproc);
+
+  if (coproc == NULL)
+    fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+  coproc->progname = progname;
+  coproc->command = command;
+  coproc->framing = framing;
+  coproc->backoff_ms = BACKOFF_MIN_MS;
+  coproc->write_fd = coproc->read_fd = -1;
+
+  /* a dead handler is noticed by EPIPE */
+  signal(SIGPIPE, SIG_IGN);
+
+  start(coproc);
+
+  return coproc;
+}
+
+void
+coprocess_free(struct coprocess *coproc)
+{
+  stop(coproc);
+
+  free(coproc->wbuf);
+  free(coproc);
+}
+
+int
+coprocess_get_fd(struct coprocess *coproc)
+{
+  return coproc->read_fd;
+}
+
+int
+coprocess_get_write_fd(struct coprocess *coproc)
+{
+  return coproc->blocked ? coproc->write_fd : -1;
+}
+
+int
+coprocess_check(struct coprocess *coproc)
+{
+  long long now;
+
+  if (coproc->pid != -1 && !coproc->blocked)
+    return -1;
+
+  if (coproc->pid != -1) {
+    if ((now = now_ms()) - coproc->blocked_ms < HUNG_MS)
+      return coproc->blocked_ms + HUNG_MS - now;
+
+    warn("%s: coprocess '%s' stopped reading its input\n", coproc->progname,
+         coproc->command);
+
+    /* it may ignore SIGTERM as well */
+    kill(coproc->pid, SIGKILL);
+    died(coproc);
+  }
+
+  if ((now = now_ms()) < coproc->restart_ms)
+    return coproc->restart_ms - now;
+
+  start(coproc);
+
+  return coproc->pid == -1 ? coproc->backoff_ms : -1;
+}
+
+void
+coprocess_write(struct coprocess *coproc, char const *msg, size_t len)
+{
+  bool newline = len > 0 && msg[len - 1] == '\n';
+  size_t frame_len;
+
+  if (coproc->pid == -1)
+    return;
+
+  if (coproc->framing == FRAMING_LENGTH) {
+    if (newline)
+      len--;
+    frame_len = 4 + len;
+  } else {
+    frame_len = len + !newline;
+  }
+
+  if (coproc->wlen + frame_len > MAX_PENDING) {
+    if (coproc->dropped++ == 0)
+      warn("%s: coprocess '%s' is not keeping up, dropping events\n",
+           coproc->progname, coproc->command);
+    return;
+  }
+
+  if (coproc->wlen + frame_len > coproc->wsize) {
+    size_t size = (coproc->wlen + frame_len) * 2;
+
+    if (size > MAX_PENDING)
+      size = MAX_PENDING;
+    char *wbuf = realloc(coproc->wbuf, size);
+
+    if (wbuf == NULL)
+      fail("%s: failed to allocate memory: %s\n", coproc->progname,
+           strerror(errno));
+
+    coproc->wbuf = wbuf;
+    coproc->wsize = size;
+  }
+
+  if (coproc->framing == FRAMING_LENGTH) {
+    unsigned char *prefix = (unsigned char *)coproc->wbuf + coproc->wlen;
+
+    prefix[0] = len >> 24 & 0xff;
+    prefix[1] = len >> 16 & 0xff;
+    prefix[2] = len >> 8 & 0xff;
+    prefix[3] = len & 0xff;
+    memcpy(coproc->wbuf + coproc->wlen + 4, msg, len);
+  } else {
+    memcpy(coproc->wbuf + coproc->wlen, msg, len);
+    if (!newline)
+      coproc->wbuf[coproc->wlen + len] = '\n';
+  }
+
+  coproc->wlen += frame_len;
+}
+
+void
+coprocess_flush(struct coprocess *coproc)
+{
+  size_t written = 0;
+
+  while (coproc->pid != -1 && written < coproc->wlen) {
+    ssize_t ret;
+
+    STATS_SYSCALL(SYSCALL_WRITE);
+    ret = write(coproc->write_fd, coproc->wbuf + written,
+                coproc->wlen - written);
+
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && errno == EAGAIN) {
+      break;
+    } else if (ret == -1) {
+      died(coproc);
+      return;
+    }
+
+    written += ret;
+
+    STATS_ADD(bytes_written, ret);
+  }
+
+  if (coproc->pid == -1)
+    return;
+
+  memmove(coproc->wbuf, coproc->wbuf + written, coproc->wlen - written);
+  coproc->wlen -= written;
+
+  /* the hang timeout runs from the last progress */
+  if (coproc->wlen > 0 && (written > 0 || !coproc->blocked))
+    coproc->blocked_ms = now_ms();
+  coproc->blocked = coproc->wlen > 0;
+
+  if (!coproc->blocked && coproc->dropped > 0) {
+    warn("%s: coprocess '%s' caught up, %lu events dropped\n",
+         coproc->progname, coproc->command, coproc->dropped);
+    coproc->dropped = 0;
+  }
+}
+
+void
+coprocess_read(struct coprocess *coproc, coprocess_handler_t handler,
+               void *data)
+{
+  size_t pos = 0;
+  ssize_t ret;
+
+  if (coproc->pid == -1 || coproc->read_fd == -1)
+    return;
+
+  ret = read(coproc->read_fd, coproc->rbuf + coproc->rlen,
+             READ_BUF_SIZE - coproc->rlen);
+
+  if (ret == -1 && errno == EINTR) {
+    return;
+  } else if (ret == 0) {
+    siginfo_t info = { .si_pid = 0 };
+
+    /* EOF also when the handler only redirected its stdout, a handler
+     * which is gone is noticed here or by EPIPE on the next write
+     */
+    close(coproc->read_fd);
+    coproc->read_fd = -1;
+    coproc->rlen = 0;
+
+    if (waitid(P_PID, coproc->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+        info.si_pid == coproc->pid)
+      died(coproc);
+    return;
+  } else if (ret == -1) {
+    died(coproc);
+    return;
+  }
+
+  coproc->rlen += ret;
+
+  while (pos < coproc->rlen) {
+    char *msg, saved;
+    size_t len;
+
+    if (coproc->framing == FRAMING_LENGTH) {
+      unsigned char *prefix = (unsigned char *)coproc->rbuf + pos;
+
+      if (coproc->rlen - pos < 4)
+        break;
+
+      len = (size_t)prefix[0] << 24 | prefix[1] << 16 | prefix[2] << 8 |
+            prefix[3];
+
+      if (len > READ_BUF_SIZE - 4) {
+        warn("%s: coprocess '%s' sent a message larger than %d bytes\n",
+             coproc->progname, coproc->command, READ_BUF_SIZE - 4);
+        died(coproc);
+        return;
+      } else if (coproc->rlen - pos - 4 < len) {
+        break;
+      }
+
+      msg = coproc->rbuf + pos + 4;
+      pos += 4 + len;
+    } else {
+      char *end = memchr(coproc->rbuf + pos, '\n', coproc->rlen - pos);
+
+      if (end == NULL)
+        break;
+
+      msg = coproc->rbuf + pos;
+      len = end - msg;
+      pos += len + 1;
+    }
+
+    /* rbuf has room for one more byte, so there is always a byte to borrow */
+    saved = msg[len];
+    msg[len] = '\0';
+    handler(msg, len, data);
+    msg[len] = saved;
+  }
+
+  if (pos == 0 && coproc->rlen == READ_BUF_SIZE) {
+    warn("%s: coprocess '%s' sent a line longer than %d bytes\n",
+         coproc->progname, coproc->command, READ_BUF_SIZE);
+    died(coproc);
+    return;
+  }
+
+  memmove(coproc->rbuf, coproc->rbuf + pos, coproc->rlen - pos);
+  coproc->rlen -= pos;
+}
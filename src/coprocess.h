@@ -0,0 +1,65 @@
+#ifndef _COPROCESS_HDR_
+#define _COPROCESS_HDR_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A handler program started once with 'sh -c' and fed events over a pipe,
+ * restarted with exponential backoff whenever it dies. Events it does not
+ * keep up with are buffered up to a limit and then dropped, a handler which
+ * reads nothing for a few seconds is restarted.
+ */
+
+typedef enum {
+  FRAMING_LINE,  /* newline terminated lines */
+  FRAMING_LENGTH /* 32-bit big-endian length followed by the payload */
+} framing_t;
+
+/* called for each message the handler writes back, without framing */
+typedef void (*coprocess_handler_t)(char *msg, size_t len, void *data);
+
+struct coprocess;
+
+struct coprocess *
+coprocess_new(char const *progname, char const *command, framing_t framing);
+
+void
+coprocess_free(struct coprocess *coproc);
+
+/* fd to poll for messages from the handler, -1 while it is not running or
+ * closed its stdout
+ */
+int
+coprocess_get_fd(struct coprocess *coproc);
+
+/* fd to poll for POLLOUT while buffered messages wait for the handler, -1
+ * otherwise
+ */
+int
+coprocess_get_write_fd(struct coprocess *coproc);
+
+/* Milliseconds until the handler is due to be restarted, or is considered
+ * hung, -1 if it is running and keeping up. Restarts the handler when the
+ * time has come.
+ */
+int
+coprocess_check(struct coprocess *coproc);
+
+/* Appends a framed message to the write buffer, which is sent by the next
+ * coprocess_flush(). Messages are dropped while the handler is not running.
+ */
+void
+coprocess_write(struct coprocess *coproc, char const *msg, size_t len);
+
+/* Writes the buffered messages with a single write, as much as the pipe
+ * takes.
+ */
+void
+coprocess_flush(struct coprocess *coproc);
+
+/* Reads the available messages of the handler and passes them to handler. */
+void
+coprocess_read(struct coprocess *coproc, coprocess_handler_t handler,
+               void *data);
+
+#endif /* #ifndef _COPROCESS_HDR_ */
@@ -3,226 +3,193 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <ctype.h>
 #include <poll.h>
 #include <errno.h>
 
-#include <libspacemouse.h>
-
 #include "options.h"
 #include "util.h"
+#include "spm.h"
+#include "coprocess.h"
+#include "output.h"
+#include "stats.h"
 
 #include "commands.h"
 
-static bool
-match_device_init(struct spacemouse *mouse, match_t const *match_opts,
-                  bool grab_opt, char const *progname)
+/* maximum number of events fetched per spm_dispatch() call */
+#define DISPATCH_EVENTS 64
+
+/* handles 'set led (on | off | switch) <devnode>' sent by the coprocess */
+static void
+coprocess_message(char *msg, size_t len, void *data)
 {
-  int err, match = match_device(mouse, match_opts);
+  char const *progname = data;
+  char state[8], devnode[256];
+  struct spacemouse *head, *iter;
+
+  if (strncmp(msg, "ack", 3) == 0)
+    return;
+
+  if (sscanf(msg, "set led %7s %255s", state, devnode) != 2 ||
+      (strcmp(state, "on") != 0 && strcmp(state, "off") != 0 &&
+       strcmp(state, "switch") != 0)) {
+    warn("%s: unknown coprocess message '%s'\n", progname, msg);
+    return;
+  }
 
-  if (match == -1) {
-    fail("%s: failed to use regex, please use valid ERE\n", progname);
-  } else if (match) {
-    int *axis_array = calloc(sizeof(int), 6);
+  if (spacemouse_device_list(&head, 0) != 0)
+    return;
 
-    if (axis_array == NULL)
-        fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
-    spacemouse_device_set_data(mouse, axis_array);
+  spacemouse_device_list_foreach(iter, head) {
+    int err, led_state = strcmp(state, "on") == 0;
+
+    if (spacemouse_device_get_fd(iter) < 0 ||
+        strcmp(spacemouse_device_get_devnode(iter), devnode) != 0)
+      continue;
+
+    if (strcmp(state, "switch") == 0) {
+      if ((led_state = spacemouse_device_get_led(iter)) < 0) {
+        warn("%s: failed to get led state for '%s': %s\n", progname, devnode,
+             strerror(-led_state));
+        return;
+      }
+      led_state = !led_state;
+    }
 
-    if ((err = spacemouse_device_open(mouse)) < 0)
-      fail("%s: failed to open device '%s': %s\n", progname,
-           spacemouse_device_get_devnode(mouse), strerror(-err));
+    if ((err = spacemouse_device_set_led(iter, led_state)) < 0)
+      warn("%s: failed to set led state for '%s': %s\n", progname, devnode,
+           strerror(-err));
 
-    if (grab_opt && (err = spacemouse_device_set_grab(mouse, 1)) < 0)
-      fail("%s: failed to grab device '%s': %s\n", progname,
-           spacemouse_device_get_devnode(mouse), strerror(-err));
+    return;
   }
 
-  return match;
+  warn("%s: coprocess requested unknown device '%s'\n", progname, devnode);
 }
 
 int
 event_command(char const *progname, options_t *options, int nargs, char **args)
 {
-  struct {
-    char const *pos, *neg;
-  } axis_str[] = {
-    { "right", "left" },
-    { "back", "forward" },
-    { "down", "up" },
-    { "pitch back", "pitch forward" },
-    { "roll left", "roll right" },
-    { "yaw right", "yaw left" },
+  struct spm_context *ctx;
+  struct spm_config config = {
+    .match = { options->match.ignore_case, options->match.device,
+               options->match.manufacturer, options->match.product },
+    .grab = options->grab,
+    .deviation = options->deviation,
+    .events = options->events,
+    .milliseconds = options->milliseconds,
+    .repeat = options->repeat,
+    .repeat_min = options->repeat_min,
+    .repeat_accel = options->repeat_accel,
+    .calibrate = options->calibrate,
+    .types = options->types,
+    .threads = options->threads,
+    .ordered = options->ordered
   };
+  int cpus[MAX_THREADS];
+  struct coprocess *coproc = NULL;
+  struct output *out = output_new(progname);
+  int err;
 
   if (nargs)
     fail("%s: invalid non-command or non-option argument(s), use the "
          "'-h'/'--help' option to display the help message\n", progname);
 
-  if (options->deviation == 0)
-    options->deviation = MIN_DEVIATION;
-  if (options->events == 0 && options->milliseconds == 0)
-    options->events = N_EVENTS;
+  /* the CPU list repeats for the remaining threads */
+  if (options->ncpus != 0) {
+    for (int idx = 0; idx < options->threads; idx++)
+      cpus[idx] = options->cpus[idx % options->ncpus];
+    config.cpus = cpus;
+  }
 
-  /* TODO: error check */
-  int monitor_fd = spacemouse_monitor_open();
+  if ((err = spm_new(&config, &ctx)) == -EINVAL)
+    fail("%s: failed to use regex, please use valid ERE\n", progname);
+  else if (err == -ENXIO)
+    fail("%s: '--cpus' option's argument contains an offline or not allowed "
+         "CPU\n", progname);
+  else if (err < 0)
+    fail("%s: failed to initialize devices: %s\n", progname, strerror(-err));
 
-  {
-    struct spacemouse *head, *iter;
-    int err = spacemouse_device_list(&head, 1);
+  /* stdout is the default, unless the events go to a coprocess */
+  if (options->noutputs == 0 && options->coprocess == NULL)
+    output_add(out, "-");
 
-    if (err) {
-      /* TODO: better message */
-      fail("%s: spacemouse_device_list() returned error '%d'\n", progname,
-           err);
-    }
+  for (int idx = 0; idx < options->noutputs; idx++)
+    output_add(out, options->outputs[idx]);
 
-    spacemouse_device_list_foreach(iter, head)
-      match_device_init(iter, &options->match, options->grab, progname);
-  }
+  if (options->coprocess != NULL)
+    coproc = coprocess_new(progname, options->coprocess, options->framing);
 
-  /* If piped to another program, that program will probably want to parse
-   * the output by line.
-   */
-  setvbuf(stdout, NULL, _IOLBF, 0);
+  stats_install_signal();
 
   while (true) {
-    int err, mouse_fd, selected_fds, fds_idx = 0, nfds = 2;
-    struct spacemouse *head, *iter;
+    spm_event_t events[DISPATCH_EVENTS];
+    int nevents, timeout = coproc ? coprocess_check(coproc) : -1;
+    struct pollfd fds[] = {
+      /* no .events, just receive errors */
+      { output_has_stdout(out) ? STDOUT_FILENO : -1, 0, 0 },
+      { spm_get_fd(ctx), POLLIN, 0 },
+      { coproc ? coprocess_get_fd(coproc) : -1, POLLIN, 0 },
+      { coproc ? coprocess_get_write_fd(coproc) : -1, POLLOUT, 0 }
+    };
+
+    STATS_SYSCALL(SYSCALL_POLL);
+    if (poll(fds, ARRLEN(fds), timeout) == -1 && errno != EINTR)
+      perror("poll");
 
-    err = spacemouse_device_list(&head, 0);
+    STATS_INC(wakeups);
 
-    if (err) {
-      /* TODO: better message */
-      fail("%s: spacemouse_device_list() returned error '%d'\n", progname,
-           err);
-    }
+    stats_poll(options->stats_fd);
 
-    spacemouse_device_list_foreach(iter, head) {
-      if (spacemouse_device_get_fd(iter) > -1)
-        nfds++;
-    }
+    if (fds[0].revents & POLLERR)
+      output_stdout_error(out);
+
+    if (fds[2].revents)
+      coprocess_read(coproc, coprocess_message, (void *)progname);
+
+    if (fds[3].revents)
+      coprocess_flush(coproc);
+
+    if (fds[1].revents == 0)
+      continue;
+
+    /* a full array means more events may be queued in the context */
+    do {
+      nevents = spm_dispatch(ctx, events, ARRLEN(events), 0);
+
+      STATS_TIME_START(format_start);
+
+      for (int idx = 0; idx < nevents; idx++) {
+        char line[256];
+        int len = spm_event_format(&events[idx], line, sizeof line);
 
-    struct pollfd fds[nfds];
-    fds[fds_idx].fd = STDOUT_FILENO;
-    fds[fds_idx++].events = 0; /* no .events, just receive errors */
+        if (events[idx].type == SPM_EVENT_ERROR)
+          fail("%s: %s", progname, line + strlen("error: "));
 
-    fds[fds_idx].fd = monitor_fd;
-    fds[fds_idx++].events = POLLIN;
+        if (len >= (int)sizeof line)
+          len = sizeof line - 1;
 
-    spacemouse_device_list_foreach(iter, head) {
-      if ((mouse_fd = spacemouse_device_get_fd(iter)) > -1) {
-        fds[fds_idx].fd = mouse_fd;
-        fds[fds_idx++].events = POLLIN;
+        if (coproc)
+          coprocess_write(coproc, line, len);
+
+        output_append(out, line, len);
       }
-    }
 
-    selected_fds = poll(fds, nfds, -1);
+      STATS_TIME_ADD(format_ns, format_start);
 
-    if (selected_fds < 1)
-      perror("poll");
+      {
+        STATS_TIME_START(output_start);
+
+        /* one write per sink and batch instead of one per event */
+        if (coproc)
+          coprocess_flush(coproc);
 
-    for (fds_idx = 0; selected_fds && fds_idx < nfds; fds_idx++) {
-      if (fds[fds_idx].revents == 0)
-        continue;
-
-      if (fds[fds_idx].fd == STDOUT_FILENO && fds[fds_idx].revents & POLLERR) {
-        exit(EX_IOERR);
-      } else if (fds[fds_idx].fd == monitor_fd) {
-        struct spacemouse *mon_mouse;
-        int action = spacemouse_monitor(&mon_mouse);
-
-        if (action == SPACEMOUSE_ACTION_ADD &&
-            match_device_init(mon_mouse, &options->match, options->grab,
-                              progname)) {
-          printf("device: %s %s %s connect\n",
-                 spacemouse_device_get_devnode(mon_mouse),
-                 spacemouse_device_get_manufacturer(mon_mouse),
-                 spacemouse_device_get_product(mon_mouse));
-        } else if (action == SPACEMOUSE_ACTION_REMOVE &&
-                   spacemouse_device_get_fd(mon_mouse) > -1) {
-          int *axis_array = spacemouse_device_get_data(mon_mouse);
-
-          printf("device: %s %s %s disconnect\n",
-                 spacemouse_device_get_devnode(mon_mouse),
-                 spacemouse_device_get_manufacturer(mon_mouse),
-                 spacemouse_device_get_product(mon_mouse));
-
-          if (axis_array != NULL)
-            free(axis_array);
-
-          if (options->grab)
-            spacemouse_device_set_grab(mon_mouse, 0);
-
-          spacemouse_device_close(mon_mouse);
-        }
-
-        selected_fds--;
-      } else {
-        spacemouse_device_list_foreach(iter, head) {
-          mouse_fd = spacemouse_device_get_fd(iter);
-          if (mouse_fd > -1 && fds[fds_idx].fd == mouse_fd) {
-            spacemouse_event_t mouse_event = { 0 };
-            int status = spacemouse_device_read_event(iter, &mouse_event);
-
-            if (status == -1) {
-              spacemouse_device_close(iter);
-            } else if (status == SPACEMOUSE_READ_SUCCESS) {
-              if (mouse_event.type == SPACEMOUSE_EVENT_MOTION) {
-                int *axis_array = &mouse_event.motion.x;
-                int *axis_cond_array = spacemouse_device_get_data(iter);
-
-                for (int idx = 0; idx < 6; idx++) {
-                  if (axis_array[idx] > options->deviation &&
-                      axis_cond_array[idx] >= 0) {
-                    if (options->milliseconds != 0) {
-                      axis_cond_array[idx] += mouse_event.motion.period;
-
-                      if (axis_cond_array[idx] > options->milliseconds) {
-                        axis_cond_array[idx] %= options->milliseconds;
-
-                        printf("motion: %s\n", axis_str[idx].pos);
-                      }
-                    } else {
-                      axis_cond_array[idx] += 1;
-
-                      if (axis_cond_array[idx] % options->events == 0)
-                        printf("motion: %s\n", axis_str[idx].pos);
-                    }
-                  } else if (axis_array[idx] < -1 * options->deviation &&
-                             axis_cond_array[idx] <= 0) {
-                    if (options->milliseconds != 0) {
-                      axis_cond_array[idx] -= mouse_event.motion.period;
-
-                      if (axis_cond_array[idx] < -1 * options->milliseconds) {
-                        axis_cond_array[idx] %= options->milliseconds;
-                        axis_cond_array[idx] *= -1;
-
-                        printf("motion: %s\n", axis_str[idx].neg);
-                      }
-                    } else {
-                      axis_cond_array[idx] -= 1;
-
-                      if (axis_cond_array[idx] % options->events == 0)
-                        printf("motion: %s\n", axis_str[idx].neg);
-                    }
-                  } else {
-                    axis_cond_array[idx] = 0;
-                  }
-                }
-              } else if (mouse_event.type == SPACEMOUSE_EVENT_BUTTON) {
-                printf("button: %d %s\n", mouse_event.button.bnum,
-                       mouse_event.button.press ? "press" : "release");
-              } else if (mouse_event.type == SPACEMOUSE_EVENT_LED) {
-                printf("led: %s\n", mouse_event.led.state ? "on" : "off");
-              }
-            }
-
-            break;
-          }
-        }
+        output_flush(out);
+
+        STATS_TIME_ADD(output_ns, output_start);
       }
-    }
+    } while (nevents == (int)ARRLEN(events));
+
+    if (nevents < 0)
+      fail("%s: spm_dispatch() failed: %s\n", progname, strerror(-nevents));
   }
 
   return EXIT_SUCCESS;
@@ -1,9 +1,19 @@
+#define _DEFAULT_SOURCE /* realpath() */
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
 
 #include <libspacemouse.h>
 
@@ -12,15 +22,52 @@
 
 #include "commands.h"
 
-typedef enum {
-  LED_NONE = 0, /* no command specified, print led state of devices */
-  LED_OFF,
-  LED_ON,
-  LED_SWITCH
-} action_t;
+/* major device number of evdev nodes (INPUT_MAJOR) */
+#define INPUT_MAJOR 13
+
+/* 3Dconnexion, and Logitech which sold the older devices */
+#define VENDOR_3DCONNEXION 0x256f
+#define VENDOR_LOGITECH 0x046d
+
+/* the 3Dconnexion devices sold under the Logitech vendor id, which is shared
+ * with all other Logitech devices
+ */
+static unsigned short const logitech_products[] = {
+  0xc603, 0xc605, 0xc606, 0xc621, 0xc623, 0xc625, 0xc626, 0xc627, 0xc628,
+  0xc629, 0xc62b, 0xc640
+};
+
+#define BITS_LONGS(n) (((n) + 8 * sizeof(long) - 1) / (8 * sizeof(long)))
+#define TEST_BIT(bits, n) \
+  (((bits)[(n) / (8 * sizeof(long))] >> ((n) % (8 * sizeof(long)))) & 1)
+
+/* a matched device of a parallel run */
+struct led_job {
+  struct spacemouse *mouse;
+
+  bool opened;
+  int led_state, new_state;
+
+  char const *failed; /* operation which failed, NULL on success */
+  int err;
+
+  long long done_us; /* when the LED was set, or read for LED_NONE */
+};
 
-static action_t
-parse_arguments(char const *progname, int nargs, char **args)
+struct led_pool {
+  action_t action;
+  bool sync;
+
+  struct led_job *jobs;
+  size_t njobs;
+  size_t next[2]; /* next job to prepare and to apply */
+
+  pthread_mutex_t lock;
+  pthread_barrier_t barrier;
+};
+
+action_t
+parse_led_arguments(char const *progname, int nargs, char **args)
 {
   action_t action = LED_NONE;
 
@@ -46,15 +93,18 @@ parse_arguments(char const *progname, int nargs, char **args)
     }
 
     if (action_matches >= 2) {
-      warn("%s: command '%s' is ambiguous; possibilities:", progname, args[0]);
+      char possibilities[64] = "";
 
       for (size_t action_idx = 0; action_idx < ARRLEN(actions); action_idx++) {
-        if (actions[action_idx] != LED_NONE)
-          warn(" '%s'", action_strs[action_idx]);
+        if (actions[action_idx] != LED_NONE) {
+          strcat(possibilities, " '");
+          strcat(possibilities, action_strs[action_idx]);
+          strcat(possibilities, "'");
+        }
       }
-      warn("\n");
 
-      exit(EXIT_FAILURE);
+      fail("%s: command '%s' is ambiguous; possibilities:%s\n", progname,
+           args[0], possibilities);
     } else if (action == LED_NONE) {
       fail("%s: command argument '%s' is invalid, use the '-h'/'--help' "
            "option to display the help message\n", progname, args[0]);
@@ -67,19 +117,335 @@ parse_arguments(char const *progname, int nargs, char **args)
   return action;
 }
 
+/* Returns the path if the devnode pattern can only mean a single node: a
+ * path without regex special characters anchored at its end, like
+ * '/dev/input/event4$', and no manufacturer or product pattern. Unanchored,
+ * '/dev/input/event1' also matches event10 to event19. The path is stored in
+ * buf.
+ */
+static char const *
+literal_devnode(match_t const *match, char *buf, size_t size)
+{
+  char const *pattern = match->device;
+  size_t len;
+
+  if (pattern == NULL || match->manufacturer != NULL ||
+      match->product != NULL || match->ignore_case)
+    return NULL;
+
+  if (*pattern == '^')
+    pattern++;
+
+  len = strlen(pattern);
+  if (len == 0 || pattern[len - 1] != '$')
+    return NULL;
+  len--;
+
+  if (*pattern != '/' || len >= size ||
+      strcspn(pattern, ".[]()*+?{}|^$\\") < len)
+    return NULL;
+
+  memcpy(buf, pattern, len);
+  buf[len] = '\0';
+
+  return buf;
+}
+
+/* true for evdev character devices, /dev/input/event<N> */
+static bool
+is_evdev(char const *path, struct stat const *st)
+{
+  char const *prefix = "/dev/input/event";
+  size_t len = strlen(prefix);
+
+  return strncmp(path, prefix, len) == 0 && path[len] != '\0' &&
+         strspn(path + len, "0123456789") == strlen(path + len) &&
+         S_ISCHR(st->st_mode) && major(st->st_rdev) == INPUT_MAJOR;
+}
+
+static bool
+is_3dconnexion(struct input_id const *id)
+{
+  if (id->vendor == VENDOR_3DCONNEXION)
+    return true;
+
+  if (id->vendor != VENDOR_LOGITECH)
+    return false;
+
+  for (size_t idx = 0; idx < ARRLEN(logitech_products); idx++) {
+    if (id->product == logitech_products[idx])
+      return true;
+  }
+
+  return false;
+}
+
+/* Handles the node directly, without enumerating all devices. Returns -1 if
+ * the node is not a 3Dconnexion device with a LED, enumerating then decides.
+ * Only evdev nodes are opened at all, spm may be installed setuid.
+ */
+static int
+led_direct(char const *progname, char const *path, action_t action)
+{
+  unsigned long ev_bits[BITS_LONGS(EV_CNT)] = { 0 };
+  unsigned long led_bits[BITS_LONGS(LED_CNT)] = { 0 };
+  char devnode[PATH_MAX];
+  struct input_id id;
+  struct stat st;
+  int fd, led_state = -1;
+
+  if (realpath(path, devnode) == NULL || stat(devnode, &st) == -1 ||
+      !is_evdev(devnode, &st))
+    return -1;
+
+  if ((fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW))
+      == -1)
+    return -1;
+
+  /* the node may have been replaced since the stat() */
+  if (fstat(fd, &st) == -1 || !is_evdev(devnode, &st) ||
+      ioctl(fd, EVIOCGID, &id) == -1 || !is_3dconnexion(&id) ||
+      ioctl(fd, EVIOCGBIT(0, sizeof ev_bits), ev_bits) == -1 ||
+      !TEST_BIT(ev_bits, EV_LED) ||
+      ioctl(fd, EVIOCGBIT(EV_LED, sizeof led_bits), led_bits) == -1 ||
+      !TEST_BIT(led_bits, LED_MISC)) {
+    close(fd);
+    return -1;
+  }
+
+  if (action == LED_NONE || action == LED_SWITCH) {
+    memset(led_bits, 0, sizeof led_bits);
+
+    if (ioctl(fd, EVIOCGLED(sizeof led_bits), led_bits) == -1)
+      fail("%s: failed to get led state for '%s': %s\n", progname, devnode,
+           strerror(errno));
+
+    led_state = TEST_BIT(led_bits, LED_MISC);
+  }
+
+  if (action == LED_NONE) {
+    printf("%s: %s\n", devnode, led_state ? "on": "off");
+  } else {
+    struct input_event event = { .type = EV_LED, .code = LED_MISC };
+
+    if (action == LED_ON)
+      event.value = 1;
+    else if (action == LED_OFF)
+      event.value = 0;
+    else if (action == LED_SWITCH)
+      event.value = !led_state;
+
+    if (write(fd, &event, sizeof event) != sizeof event)
+      fail("%s: failed to set led state for '%s': %s\n", progname, devnode,
+           strerror(errno));
+
+    if (action == LED_SWITCH)
+      printf("%s: switched %s\n", devnode, event.value ? "on": "off");
+  }
+
+  close(fd);
+
+  return EXIT_SUCCESS;
+}
+
+static struct led_job *
+next_job(struct led_pool *pool, int phase)
+{
+  struct led_job *job = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->next[phase] < pool->njobs)
+    job = &pool->jobs[pool->next[phase]++];
+  pthread_mutex_unlock(&pool->lock);
+
+  return job;
+}
+
+/* opens the device and reads its LED state if the action needs it */
+static void
+led_prepare(struct led_job *job, action_t action)
+{
+  int err;
+
+  if ((err = spacemouse_device_open(job->mouse)) < 0) {
+    job->failed = "open device";
+    job->err = err;
+    return;
+  }
+
+  job->opened = true;
+
+  if (action == LED_NONE || action == LED_SWITCH) {
+    if ((job->led_state = spacemouse_device_get_led(job->mouse)) < 0) {
+      job->failed = "get led state";
+      job->err = job->led_state;
+      return;
+    }
+  }
+
+  if (action == LED_ON)
+    job->new_state = 1;
+  else if (action == LED_OFF)
+    job->new_state = 0;
+  else if (action == LED_SWITCH)
+    job->new_state = !job->led_state;
+}
+
+static void
+led_apply(struct led_job *job, action_t action)
+{
+  int err;
+
+  if (job->failed == NULL && action != LED_NONE &&
+      (err = spacemouse_device_set_led(job->mouse, job->new_state)) < 0) {
+    job->failed = "set led state";
+    job->err = err;
+  }
+
+  job->done_us = now_us();
+
+  if (job->opened)
+    spacemouse_device_close(job->mouse);
+}
+
+static void *
+led_worker(void *arg)
+{
+  struct led_pool *pool = arg;
+  struct led_job *job;
+
+  if (!pool->sync) {
+    while ((job = next_job(pool, 0)) != NULL) {
+      led_prepare(job, pool->action);
+      led_apply(job, pool->action);
+    }
+
+    return NULL;
+  }
+
+  /* every device is open and read before the first LED changes */
+  while ((job = next_job(pool, 0)) != NULL)
+    led_prepare(job, pool->action);
+
+  pthread_barrier_wait(&pool->barrier);
+
+  while ((job = next_job(pool, 1)) != NULL)
+    led_apply(job, pool->action);
+
+  return NULL;
+}
+
+/* Handles the matched devices with a pool of worker threads. Prints a line
+ * with the state or the error of each device and the time between the
+ * first and the last device completing.
+ */
+static int
+led_parallel(char const *progname, options_t *options, action_t action,
+             struct spacemouse *head)
+{
+  struct led_pool pool = { action, options->sync };
+  struct spacemouse *iter;
+  pthread_t threads[MAX_THREADS];
+  int nthreads, err, ret = EXIT_SUCCESS;
+  long long first = 0, last = 0;
+
+  spacemouse_device_list_foreach(iter, head) {
+    int match = match_device(iter, &options->match);
+
+    if (match == -1)
+      fail("%s: failed to use regex, please use valid ERE\n", progname);
+    else if (match)
+      pool.njobs++;
+  }
+
+  if (pool.njobs == 0)
+    return action == LED_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if ((pool.jobs = calloc(pool.njobs, sizeof *pool.jobs)) == NULL)
+    fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+  spacemouse_device_list_foreach(iter, head) {
+    if (match_device(iter, &options->match) == 1)
+      pool.jobs[pool.next[0]++].mouse = iter;
+  }
+  pool.next[0] = 0;
+
+  /* the calling thread is one of the workers */
+  nthreads = options->parallel < (int)pool.njobs ? options->parallel :
+                                                   (int)pool.njobs;
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_barrier_init(&pool.barrier, NULL, nthreads);
+
+  for (int idx = 1; idx < nthreads; idx++) {
+    if ((err = pthread_create(&threads[idx], NULL, led_worker, &pool)) != 0)
+      fail("%s: failed to start worker thread: %s\n", progname,
+           strerror(err));
+  }
+
+  led_worker(&pool);
+
+  for (int idx = 1; idx < nthreads; idx++)
+    pthread_join(threads[idx], NULL);
+
+  pthread_barrier_destroy(&pool.barrier);
+  pthread_mutex_destroy(&pool.lock);
+
+  for (size_t idx = 0; idx < pool.njobs; idx++) {
+    struct led_job *job = &pool.jobs[idx];
+    char const *devnode = spacemouse_device_get_devnode(job->mouse);
+
+    if (job->failed != NULL) {
+      printf("%s: error: failed to %s: %s\n", devnode, job->failed,
+             strerror(-job->err));
+      ret = EXIT_FAILURE;
+      continue;
+    }
+
+    if (action == LED_NONE)
+      printf("%s: %s\n", devnode, job->led_state ? "on" : "off");
+    else
+      printf("%s: %s%s\n", devnode, action == LED_SWITCH ? "switched " : "",
+             job->new_state ? "on" : "off");
+
+    if (first == 0 || job->done_us < first)
+      first = job->done_us;
+    if (job->done_us > last)
+      last = job->done_us;
+  }
+
+  if (first != 0)
+    warn("%s: devices completed within %lld us\n", progname, last - first);
+
+  free(pool.jobs);
+
+  return ret;
+}
+
 int
 led_command(char const *progname, options_t *options, int nargs, char **args)
 {
-  action_t action = parse_arguments(progname, nargs, args);
+  action_t action = parse_led_arguments(progname, nargs, args);
   struct spacemouse *head, *iter;
-  int ret = (action == LED_NONE) ? EXIT_SUCCESS : EXIT_FAILURE;
-  int err = spacemouse_device_list(&head, 1);
+  char path_buf[256];
+  char const *devnode = literal_devnode(&options->match, path_buf,
+                                        sizeof path_buf);
+  int ret, err;
 
-  if (err) {
+  if (devnode != NULL && options->parallel == 0 &&
+      (ret = led_direct(progname, devnode, action)) != -1)
+    return ret;
+
+  ret = (action == LED_NONE) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if ((err = spacemouse_device_list(&head, 1)) != 0) {
     /* TODO: better message */
     fail("%s: spacemouse_device_list() returned error '%d'\n", progname, err);
   }
 
+  if (options->parallel != 0)
+    return led_parallel(progname, options, action, head);
+
   spacemouse_device_list_foreach(iter, head) {
     int match = match_device(iter, &options->match);
 
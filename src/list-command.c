@@ -1,8 +1,13 @@
+#define _GNU_SOURCE /* ppoll() */
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <libspacemouse.h>
 
@@ -11,6 +16,256 @@
 
 #include "commands.h"
 
+struct inventory_entry {
+  char *devnode, *manufacturer, *product;
+};
+
+/* matched devices, sorted by devnode */
+struct inventory {
+  struct inventory_entry *entries;
+  size_t len, size;
+};
+
+static volatile sig_atomic_t snapshot_requested = 0;
+
+static void
+request_snapshot(int signum)
+{
+  snapshot_requested = 1;
+}
+
+static void
+print_json_string(char const *str)
+{
+  putchar('"');
+
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      printf("\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      printf("\\u%04x", *str);
+    else
+      putchar(*str);
+  }
+
+  putchar('"');
+}
+
+static void
+print_json_entry(struct inventory_entry const *entry)
+{
+  fputs("\"devnode\":", stdout);
+  print_json_string(entry->devnode);
+  fputs(",\"manufacturer\":", stdout);
+  print_json_string(entry->manufacturer);
+  fputs(",\"product\":", stdout);
+  print_json_string(entry->product);
+}
+
+static void
+print_entry(struct inventory_entry const *entry)
+{
+  printf("devnode: %s\n", entry->devnode);
+  printf("manufacturer: %s\n", entry->manufacturer);
+  printf("product: %s\n\n", entry->product);
+}
+
+static void
+print_snapshot(struct inventory const *inv, bool json)
+{
+  if (json) {
+    fputs("{\"action\":\"snapshot\",\"devices\":[", stdout);
+    for (size_t idx = 0; idx < inv->len; idx++) {
+      fputs(idx ? ",{" : "{", stdout);
+      print_json_entry(&inv->entries[idx]);
+      putchar('}');
+    }
+    puts("]}");
+  } else {
+    for (size_t idx = 0; idx < inv->len; idx++)
+      print_entry(&inv->entries[idx]);
+  }
+}
+
+static void
+print_change(struct inventory_entry const *entry, bool add, bool json)
+{
+  if (json) {
+    printf("{\"action\":\"%s\",", add ? "add" : "remove");
+    print_json_entry(entry);
+    puts("}");
+  } else {
+    printf("%s: %s %s %s\n", add ? "add" : "remove", entry->devnode,
+           entry->manufacturer, entry->product);
+  }
+}
+
+/* index of devnode in the inventory or where it would have to be inserted */
+static size_t
+inventory_find(struct inventory const *inv, char const *devnode, bool *found)
+{
+  size_t low = 0, high = inv->len;
+
+  *found = false;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    int cmp = strcmp(inv->entries[mid].devnode, devnode);
+
+    if (cmp == 0) {
+      *found = true;
+      return mid;
+    } else if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+static struct inventory_entry *
+inventory_add(char const *progname, struct inventory *inv,
+              struct spacemouse *mouse)
+{
+  bool found;
+  size_t idx = inventory_find(inv, spacemouse_device_get_devnode(mouse),
+                              &found);
+  struct inventory_entry *entry;
+
+  if (found)
+    return NULL;
+
+  if (inv->len == inv->size) {
+    size_t size = inv->size ? inv->size * 2 : 8;
+    struct inventory_entry *entries = realloc(inv->entries,
+                                              size * sizeof *entries);
+
+    if (entries == NULL)
+      fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+    inv->entries = entries;
+    inv->size = size;
+  }
+
+  entry = &inv->entries[idx];
+  memmove(entry + 1, entry, (inv->len - idx) * sizeof *entry);
+  inv->len++;
+
+  entry->devnode = strdup(spacemouse_device_get_devnode(mouse));
+  entry->manufacturer = strdup(spacemouse_device_get_manufacturer(mouse));
+  entry->product = strdup(spacemouse_device_get_product(mouse));
+
+  if (!entry->devnode || !entry->manufacturer || !entry->product)
+    fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+  return entry;
+}
+
+/* removes and prints the entry of mouse, if there is one */
+static void
+inventory_remove(struct inventory *inv, struct spacemouse *mouse, bool json)
+{
+  bool found;
+  size_t idx = inventory_find(inv, spacemouse_device_get_devnode(mouse),
+                              &found);
+  struct inventory_entry *entry = &inv->entries[idx];
+
+  if (!found)
+    return;
+
+  print_change(entry, false, json);
+
+  free(entry->devnode);
+  free(entry->manufacturer);
+  free(entry->product);
+
+  memmove(entry, entry + 1, (inv->len - idx - 1) * sizeof *entry);
+  inv->len--;
+}
+
+/* print the inventory once, then only the changes until stdout is closed */
+static int
+watch(char const *progname, options_t *options)
+{
+  struct inventory inv = { NULL, 0, 0 };
+  struct spacemouse *head, *iter;
+  struct sigaction action = { .sa_handler = request_snapshot };
+  sigset_t usr1, unblocked;
+  int err, monitor_fd = spacemouse_monitor_open();
+
+  if (monitor_fd < 0)
+    fail("%s: failed to open device monitor: %s\n", progname,
+         strerror(-monitor_fd));
+
+  if ((err = spacemouse_device_list(&head, 1)) != 0)
+    fail("%s: failed to list devices: %s\n", progname, strerror(-err));
+
+  spacemouse_device_list_foreach(iter, head) {
+    int match = match_device(iter, &options->match);
+
+    if (match == -1)
+      fail("%s: failed to use regex, please use valid ERE\n", progname);
+    else if (match)
+      inventory_add(progname, &inv, iter);
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  /* SIGUSR1 is only delivered inside ppoll(), which returns for it, so a
+   * request arriving after the check of snapshot_requested is not missed
+   */
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &usr1, &unblocked);
+  sigdelset(&unblocked, SIGUSR1);
+
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+
+  print_snapshot(&inv, options->json);
+
+  while (true) {
+    struct pollfd fds[] = {
+      { STDOUT_FILENO, 0, 0 }, /* no .events, just receive errors */
+      { monitor_fd, POLLIN, 0 }
+    };
+
+    if (ppoll(fds, ARRLEN(fds), NULL, &unblocked) == -1 && errno != EINTR)
+      fail("%s: ppoll() error: %s\n", progname, strerror(errno));
+
+    if (snapshot_requested) {
+      snapshot_requested = 0;
+      print_snapshot(&inv, options->json);
+    }
+
+    if (fds[0].revents & POLLERR)
+      exit(EX_IOERR);
+
+    if (fds[1].revents & POLLIN) {
+      struct spacemouse *mon_mouse;
+      struct inventory_entry *entry;
+      int action = spacemouse_monitor(&mon_mouse);
+
+      if (action != SPACEMOUSE_ACTION_ADD &&
+          action != SPACEMOUSE_ACTION_REMOVE)
+        continue;
+
+      if (match_device(mon_mouse, &options->match) != 1)
+        continue;
+
+      if (action == SPACEMOUSE_ACTION_ADD &&
+          (entry = inventory_add(progname, &inv, mon_mouse)) != NULL)
+        print_change(entry, true, options->json);
+      else if (action == SPACEMOUSE_ACTION_REMOVE)
+        inventory_remove(&inv, mon_mouse, options->json);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
 int
 list_command(char const *progname, options_t *options, int nargs, char **args)
 {
@@ -18,6 +273,9 @@ list_command(char const *progname, options_t *options, int nargs, char **args)
     fail("%s: invalid non-command or non-option argument(s), use the "
          "'-h'/'--help' option to display the help message\n", progname);
 
+  if (options->watch)
+    return watch(progname, options);
+
   {
     struct spacemouse *head, *iter;
 
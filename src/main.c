@@ -17,8 +17,10 @@ main(int argc, char **argv)
   if (argc >= 2) {
     size_t arg_len = strlen(argv[1]);
 
-    cmd_t cmds[] = { LIST_CMD, LIST_CMD, LED_CMD, EVENT_CMD, RAW_CMD };
-    char const *cmd_strs[] = { "list", "ls", "led", "event", "raw" };
+    cmd_t cmds[] = { LIST_CMD, LIST_CMD, LED_CMD, EVENT_CMD, RAW_CMD,
+                     PROXY_CMD, BATCH_CMD };
+    char const *cmd_strs[] = { "list", "ls", "led", "event", "raw", "proxy",
+                               "batch" };
 
     for (size_t cmd_idx = 0; cmd_idx < ARRLEN(cmds); cmd_idx++) {
       if (strncmp(argv[1], cmd_strs[cmd_idx], arg_len) == 0) {
@@ -70,6 +72,14 @@ main(int argc, char **argv)
         return raw_command(argv[0], &options, args_left, remaining_args);
         break;
 
+      case PROXY_CMD:
+        return proxy_command(argv[0], &options, args_left, remaining_args);
+        break;
+
+      case BATCH_CMD:
+        return batch_command(argv[0], &options, args_left, remaining_args);
+        break;
+
       case LIST_CMD:
       default:
         return list_command(argv[0], &options, args_left, remaining_args);
@@ -6,12 +6,23 @@
 
 #include <getopt.h>
 
-#include "commands.h" /* MIN_DEVIATION and N_EVENTS definition */
+#include "commands.h" /* MIN_DEVIATION, N_EVENTS and other defaults */
 #include "util.h"
 
 #include "options.h"
 
 #define VERSION_RET 128
+#define STATS_FD_RET 129
+#define REPEAT_MIN_RET 130
+#define REPEAT_ACCEL_RET 131
+#define CPUS_RET 132
+#define ORDERED_RET 133
+#define SYNC_RET 134
+#define CALIBRATE_RET 135
+#define TYPES_RET 136
+
+/* CPU_SETSIZE, which is not available without _GNU_SOURCE */
+#define MAX_CPU 1024
 
 static char const help_message[] = \
 "Usage: spm [OPTIONS]\n"
@@ -19,6 +30,9 @@ static char const help_message[] = \
 "       spm led [OPTIONS] (on | 1) | (off | 0)\n"
 "       spm led [OPTIONS] (switch | !)\n"
 "       spm event [OPTIONS] (--events <N> | --milliseconds <MILLISECONDS>)\n"
+"       spm proxy [OPTIONS] [--deviation <DEVIATION>]\n"
+"       spm list [OPTIONS] [--watch [--json]]\n"
+"       spm batch [OPTIONS] [--socket <PATH>]\n"
 "       spm (-h | --help)\n"
 "\n"
 "Commands: (defaults to 'list' if no command is specified)\n"
@@ -26,10 +40,19 @@ static char const help_message[] = \
 "  led: Print or manipulate the LED state of connected 3D/6DoF input devices\n"
 "  event: Print events generated by connected 3D/6DoF input devices\n"
 "  raw: Print comprehensive info of raw events and device changes\n"
+"  proxy: Grab connected 3D/6DoF input devices and re-emit their events on\n"
+"         virtual (uinput) devices\n"
+"  batch: Keep the devices open and run 'led', 'list' and 'stats' commands\n"
+"         read line by line, with the options and arguments of the command\n"
+"         line, each answer line is prefixed with a sequence id and the\n"
+"         last one is 'ok' or 'error: <message>'\n"
 "\n"
 "Options:\n"
 "  -D, --devnode=DEV          regular expression (ERE) which devices'\n"
-"                             devnode string must match\n"
+"                             devnode string must match, for the led\n"
+"                             command a plain path ending in '$' opens\n"
+"                             just that node without enumerating the\n"
+"                             devices\n"
 "  -M, --manufacturer=MAN     regular expression (ERE) which devices'\n"
 "                             manufacturer string must match\n"
 "  -P, --product=PRO          regular expression (ERE) which devices'\n"
@@ -38,6 +61,21 @@ static char const help_message[] = \
 "  -h, --help                 display this help\n"
 "      --version              display version information\n"
 "\n"
+"Additional options for list command:\n"
+"  -w, --watch                print the devices, then print 'add: ' and\n"
+"                             'remove: ' lines as devices are (dis)connected;\n"
+"                             SIGUSR1 prints all devices again\n"
+"  -j, --json                 print one JSON object per line when watching\n"
+"\n"
+"Additional options for led command:\n"
+"  -p, --parallel[=N]         handle the devices concurrently with N worker\n"
+"                             threads, printing a line per device with its\n"
+"                             state or error instead of stopping at the\n"
+"                             first error, default is: " STR(LED_WORKERS) "\n"
+"      --sync                 open all devices and read their state before\n"
+"                             changing any LED, so they flip at once,\n"
+"                             implies '--parallel'\n"
+"\n"
 "Additional options for event command:\n"
 "  -g, --grab                 grab matched/all devices\n"
 "  -d, --deviation=DEVIATION  minimum deviation on an motion axis needed\n"
@@ -49,21 +87,103 @@ static char const help_message[] = \
 "                             default is: " STR(N_EVENTS) "\n"
 "  -m, --milliseconds=        millisecond period in which consecutive\n"
 "               MILLISECONDS  events' deviaton must exceed minimum deviation\n"
-"                             before printing an event to stdout";
+"                             before printing an event to stdout\n"
+"  -r, --repeat=MILLISECONDS  with '-m', repeat the event every MILLISECONDS\n"
+"                             while the deviation persists, even when the\n"
+"                             device stops reporting\n"
+"      --repeat-min=          shortest repeat interval\n"
+"               MILLISECONDS  default is: " STR(MIN_REPEAT) "\n"
+"      --repeat-accel=PERCENT shorten the repeat interval by PERCENT with\n"
+"                             every repeat, default is: 0\n"
+"      --types=TYPES          comma separated event types to print:\n"
+"                             'motion', 'button', 'led' and 'device',\n"
+"                             device events are always printed; the other\n"
+"                             types are masked in the kernel so they do\n"
+"                             not even wake spm up\n"
+"      --calibrate[=EVENTS]   derive a deviation per device and axis from\n"
+"                             the noise of the first EVENTS motion events\n"
+"                             at rest and keep adapting it while the axis\n"
+"                             is idle, '-d' becomes the lower bound\n"
+"                             default is: " STR(CALIBRATE_EVENTS) "\n"
+"  -c, --coprocess=CMD        start CMD once and write events to its stdin\n"
+"                             instead of stdout, restarting it if it dies;\n"
+"                             CMD may write back 'set led (on | off |\n"
+"                             switch) <devnode>', other messages are ignored\n"
+"  -f, --framing=FRAMING      framing of coprocess messages: 'line' or\n"
+"                             'length' (32-bit big-endian length prefix)\n"
+"                             default is: line\n"
+"  -t, --threads=N            shard the devices across N worker threads,\n"
+"                             each reading and filtering its own devices\n"
+"      --cpus=LIST            comma separated CPUs to pin the threads to,\n"
+"                             repeated if shorter than the thread count\n"
+"      --ordered              merge the events of the threads in the order\n"
+"                             they were read instead of thread by thread\n"
+"  -o, --output=SINK          write events to SINK instead of stdout, can be\n"
+"                             given up to " STR(MAX_OUTPUTS) " times, events\n"
+"                             are formatted once for all sinks:\n"
+"                               '-' or 'stdout'\n"
+"                               'file:PATH' appends to PATH\n"
+"                               'unix:PATH' connects to a stream socket\n"
+"                               'dgram:PATH' sends datagrams, a PATH of\n"
+"                               '@NAME' is in the abstract namespace\n"
+"                             followed by comma separated settings:\n"
+"                               'policy=exit|drop' on write errors, default\n"
+"                               is exit for stdout and files\n"
+"                               'buffer=BYTES' of unwritten output to keep\n"
+"                               'rotate=BYTES' and 'keep=N' rotate files\n"
+"\n"
+"Additional options for proxy command:\n"
+"  -d, --deviation=DEVIATION  axis values within the deviation are sent as\n"
+"                             zero, default is: 0\n"
+"\n"
+"Additional options for event and raw commands:\n"
+"      --stats-fd=FD          file descriptor SIGUSR1 prints the hot path\n"
+"                             counters to, only available when built with\n"
+"                             'make STATS=1', default is: 2 (stderr)\n"
+"\n"
+"Additional options for batch command:\n"
+"  -s, --socket=PATH          read commands from clients of a unix socket at\n"
+"                             PATH instead of stdin";
 
 int
 parse_options(int argc, char **argv, options_t *options, cmd_t cmd)
 {
   int c;
+  char *command = NULL;
 
   int longindex = 0;
-  char *optstring = cmd == EVENT_CMD ? "D:M:P:ihgd:n:m:" : "D:M:P:ih";
+  char *optstring = cmd == EVENT_CMD ? "D:M:P:ihgd:n:m:r:c:f:o:t:" :
+                   cmd == PROXY_CMD ? "D:M:P:ihd:" :
+                   cmd == BATCH_CMD ? "D:M:P:ihs:" :
+                   cmd == LED_CMD ? "D:M:P:ihp::" :
+                   cmd == LIST_CMD || cmd == NO_CMD ? "D:M:P:ihwj" : "D:M:P:ih";
   struct option longopts[] = {
+    /* list command specific options */
+    { "watch", no_argument, NULL, 'w' },
+    { "json", no_argument, NULL, 'j' },
+    /* led command specific options */
+    { "parallel", optional_argument, NULL, 'p' },
+    { "sync", no_argument, NULL, SYNC_RET },
     /* event command specific options */
     { "grab", no_argument, NULL, 'g' },
     { "deviation", required_argument, NULL, 'd' },
     { "events", required_argument, NULL, 'n' },
     { "milliseconds", required_argument, NULL, 'm' },
+    { "repeat", required_argument, NULL, 'r' },
+    { "repeat-min", required_argument, NULL, REPEAT_MIN_RET },
+    { "repeat-accel", required_argument, NULL, REPEAT_ACCEL_RET },
+    { "calibrate", optional_argument, NULL, CALIBRATE_RET },
+    { "types", required_argument, NULL, TYPES_RET },
+    { "coprocess", required_argument, NULL, 'c' },
+    { "framing", required_argument, NULL, 'f' },
+    { "output", required_argument, NULL, 'o' },
+    { "threads", required_argument, NULL, 't' },
+    { "cpus", required_argument, NULL, CPUS_RET },
+    { "ordered", no_argument, NULL, ORDERED_RET },
+    /* event and raw command specific options */
+    { "stats-fd", required_argument, NULL, STATS_FD_RET },
+    /* batch command specific options */
+    { "socket", required_argument, NULL, 's' },
     /* common options */
     { "devnode", required_argument, NULL, 'D' },
     { "manufacturer", required_argument, NULL, 'M' },
@@ -75,9 +195,18 @@ parse_options(int argc, char **argv, options_t *options, cmd_t cmd)
   };
 
   if (cmd != EVENT_CMD)
-    longindex = 4;
-  if (cmd != NO_CMD)
-    optind = 2;
+    longindex = 21;
+
+  /* optind 0 makes getopt_long() start over, the batch command parses every
+   * line; the command argument is hidden behind the program name meanwhile
+   */
+  if (cmd != NO_CMD) {
+    command = argv[1];
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+  }
+  optind = 0;
 
   while ((c = getopt_long(argc, argv, optstring, longopts, &longindex))
          != -1) {
@@ -99,6 +228,28 @@ parse_options(int argc, char **argv, options_t *options, cmd_t cmd)
         options->match.ignore_case = true;
         break;
 
+      case 'w':
+        options->watch = true;
+        break;
+
+      case 'j':
+        options->json = true;
+        break;
+
+      case 'p':
+        if (optarg == NULL)
+          options->parallel = LED_WORKERS;
+        else if ((tmp = atoi(optarg)) < 1 || tmp > MAX_THREADS)
+          fail("%s: '-p'/'--parallel' option's argument needs to be an "
+               "integer from 1 to " STR(MAX_THREADS) "\n", argv[0]);
+        else
+          options->parallel = tmp;
+        break;
+
+      case SYNC_RET:
+        options->sync = true;
+        break;
+
       case 'g':
         options->grab = true;
         break;
@@ -127,13 +278,161 @@ parse_options(int argc, char **argv, options_t *options, cmd_t cmd)
           options->milliseconds = tmp;
         break;
 
+      case 'r':
+        if ((tmp = atoi(optarg)) < 1)
+          fail("%s: '-r'/'--repeat' option's argument needs to be a valid "
+               "positive integer\n", argv[0]);
+        else
+          options->repeat = tmp;
+        break;
+
+      case REPEAT_MIN_RET:
+        if ((tmp = atoi(optarg)) < 1)
+          fail("%s: '--repeat-min' option's argument needs to be a valid "
+               "positive integer\n", argv[0]);
+        else
+          options->repeat_min = tmp;
+        break;
+
+      case REPEAT_ACCEL_RET:
+        if ((tmp = atoi(optarg)) < 0 || tmp > 99 ||
+            (tmp == 0 && strcmp(optarg, "0")))
+          fail("%s: '--repeat-accel' option's argument needs to be an "
+               "integer from 0 to 99\n", argv[0]);
+        else
+          options->repeat_accel = tmp;
+        break;
+
+      case CALIBRATE_RET:
+        if (optarg == NULL)
+          options->calibrate = CALIBRATE_EVENTS;
+        else if ((tmp = atoi(optarg)) < 2)
+          fail("%s: '--calibrate' option's argument needs to be an integer "
+               "greater than 1\n", argv[0]);
+        else
+          options->calibrate = tmp;
+        break;
+
+      case TYPES_RET:
+        options->types = 0;
+
+        for (char const *type = optarg; ; type += strcspn(type, ",") + 1) {
+          size_t len = strcspn(type, ",");
+          char const *names[] = { "motion", "button", "buttons", "led",
+                                  "device" };
+          unsigned bits[] = { SPM_TYPE_MOTION, SPM_TYPE_BUTTON,
+                              SPM_TYPE_BUTTON, SPM_TYPE_LED,
+                              SPM_TYPE_DEVICE };
+          size_t idx;
+
+          for (idx = 0; idx < ARRLEN(names); idx++) {
+            if (strlen(names[idx]) == len &&
+                strncmp(type, names[idx], len) == 0)
+              break;
+          }
+
+          if (idx == ARRLEN(names))
+            fail("%s: '--types' option's argument needs to be a comma "
+                 "separated list of 'motion', 'button', 'led' and "
+                 "'device'\n", argv[0]);
+
+          options->types |= bits[idx];
+
+          if (type[len] == '\0')
+            break;
+        }
+        break;
+
+      case 'c':
+        options->coprocess = optarg;
+        break;
+
+      case 'f':
+        if (strcmp(optarg, "line") == 0)
+          options->framing = FRAMING_LINE;
+        else if (strcmp(optarg, "length") == 0)
+          options->framing = FRAMING_LENGTH;
+        else
+          fail("%s: '-f'/'--framing' option's argument needs to be 'line' or "
+               "'length'\n", argv[0]);
+        break;
+
+      case 'o':
+        if (options->noutputs == MAX_OUTPUTS)
+          fail("%s: option '-o'/'--output' can be given at most "
+               STR(MAX_OUTPUTS) " times\n", argv[0]);
+        options->outputs[options->noutputs++] = optarg;
+        break;
+
+      case 't':
+        if ((tmp = atoi(optarg)) < 1 || tmp > MAX_THREADS)
+          fail("%s: '-t'/'--threads' option's argument needs to be an "
+               "integer from 1 to " STR(MAX_THREADS) "\n", argv[0]);
+        else
+          options->threads = tmp;
+        break;
+
+      case CPUS_RET:
+        options->ncpus = 0;
+
+        for (char *cpu = optarg, *end; ; cpu = end + 1) {
+          long val = strtol(cpu, &end, 10);
+
+          if (end == cpu || val < 0 || val >= MAX_CPU ||
+              (*end != ',' && *end != '\0') ||
+              options->ncpus == MAX_THREADS)
+            fail("%s: '--cpus' option's argument needs to be a comma "
+                 "separated list of at most " STR(MAX_THREADS) " CPU "
+                 "numbers\n", argv[0]);
+
+          options->cpus[options->ncpus++] = val;
+
+          if (*end == '\0')
+            break;
+        }
+        break;
+
+      case ORDERED_RET:
+        options->ordered = true;
+        break;
+
+      case STATS_FD_RET:
+#ifndef SPM_STATS
+        fail("%s: option '--stats-fd' requires spm to be built with "
+             "'make STATS=1'\n", argv[0]);
+#endif
+        if ((tmp = atoi(optarg)) < 0 || (tmp == 0 && strcmp(optarg, "0")))
+          fail("%s: '--stats-fd' option's argument needs to be a valid file "
+               "descriptor\n", argv[0]);
+        else
+          options->stats_fd = tmp;
+        break;
+
+      case 's':
+        options->socket = optarg;
+        break;
+
+      /* the batch command turns off opterr and gets the errors by fail() */
       case 'h':
+        if (!opterr)
+          fail("%s: option '-h'/'--help' is not available in batch\n",
+               argv[0]);
         puts(help_message);
       case '?':
-        exit(EXIT_FAILURE);
+        if (opterr)
+          exit(EXIT_FAILURE);
+        else if (optopt != 0 && strchr(optstring, optopt) != NULL)
+          fail("%s: option requires an argument -- '%c'\n", argv[0], optopt);
+        else if (optopt != 0)
+          fail("%s: invalid option -- '%c'\n", argv[0], optopt);
+        fail("%s: unrecognized option '%s'\n", argv[0], argv[optind - 1]);
         break;
 
       case VERSION_RET:
+        if (!opterr)
+          fail("%s: option '--version' is not available in batch\n",
+               argv[0]);
+
         puts("spm version " STR(VERSION));
 
         exit(EXIT_SUCCESS);
@@ -141,10 +440,36 @@ parse_options(int argc, char **argv, options_t *options, cmd_t cmd)
     }
   }
 
+  /* synchronized changes need the devices opened in parallel */
+  if (options->sync && options->parallel == 0)
+    options->parallel = LED_WORKERS;
+
+  if (options->json && !options->watch)
+    fail("%s: option '-j'/'--json' requires '-w'/'--watch'\n", argv[0]);
+
   if (options->events != 0 && options->milliseconds != 0)
     fail("%s: options '-n'/'--events' and '-m'/'--milliseconds' are mutually "
          "exclusive\n", argv[0]);
 
+  if ((options->repeat != 0 || options->repeat_min != 0 ||
+       options->repeat_accel != 0) && options->milliseconds == 0)
+    fail("%s: options '-r'/'--repeat', '--repeat-min' and '--repeat-accel' "
+         "require '-m'/'--milliseconds'\n", argv[0]);
+
+  if ((options->ncpus != 0 || options->ordered) && options->threads == 0)
+    fail("%s: options '--cpus' and '--ordered' require '-t'/'--threads'\n",
+         argv[0]);
+
+  if ((options->repeat_min != 0 || options->repeat_accel != 0) &&
+      options->repeat == 0)
+    fail("%s: options '--repeat-min' and '--repeat-accel' require "
+         "'-r'/'--repeat'\n", argv[0]);
+
+  if (command != NULL) {
+    argv[0] = command;
+    optind++;
+  }
+
   /* return number of arguments consumed */
   return optind;
 }
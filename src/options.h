@@ -1,6 +1,12 @@
 #ifndef _OPTIONS_HDR_
 #define _OPTIONS_HDR_
 
+#include "coprocess.h"
+
+#define MAX_OUTPUTS 8
+#define MAX_THREADS 64
+#define LED_WORKERS 8
+
 typedef struct match {
   bool ignore_case;
 
@@ -11,22 +17,73 @@ typedef struct
 {
   match_t match;
 
+  /* list command specific options */
+  bool watch;
+  bool json;
+
+  /* led command specific options */
+  int parallel;
+  bool sync;
+
   /* event command specific options */
   bool grab;
 
   int deviation;
   int events;
   int milliseconds;
+  int repeat;
+  int repeat_min;
+  int repeat_accel;
+  int calibrate;
+  unsigned types;
+
+  char const *coprocess;
+  framing_t framing;
+
+  char const *outputs[MAX_OUTPUTS];
+  int noutputs;
+
+  int threads;
+  int cpus[MAX_THREADS];
+  int ncpus;
+  bool ordered;
+
+  /* event and raw command specific options */
+  int stats_fd;
+
+  /* batch command specific options */
+  char const *socket;
 } options_t;
 
 #include "commands.h"
 
 #define init_options(options) (options).match = (match_t){ false, 0 }; \
+                               /* list command specific options */ \
+                               (options).watch = false; \
+                               (options).json = false; \
+                               /* led command specific options */ \
+                               (options).parallel = 0; \
+                               (options).sync = false; \
                                /* event command specific options */ \
                                (options).grab = false; \
                                (options).deviation = 0; \
                                (options).events = 0; \
-                               (options).milliseconds = 0;
+                               (options).milliseconds = 0; \
+                               (options).repeat = 0; \
+                               (options).repeat_min = 0; \
+                               (options).repeat_accel = 0; \
+                               (options).calibrate = 0; \
+                               (options).types = 0; \
+                               (options).coprocess = NULL; \
+                               (options).framing = FRAMING_LINE; \
+                               (options).noutputs = 0; \
+                               (options).threads = 0; \
+                               (options).ncpus = 0; \
+                               (options).ordered = false; \
+                               /* event and raw command specific options */ \
+                               (options).stats_fd = STDERR_FILENO; \
+                               /* batch command specific options */ \
+                               (options).socket = NULL;
 
 int
 parse_options(int argc, char **argv, options_t *options, cmd_t cmd);
@@ -0,0 +1,483 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "stats.h"
+
+#include "output.h"
+
+#define DEFAULT_BUFFER_SIZE 65536
+/* delay before a failed sink with the drop policy is reopened */
+#define RETRY_MS 1000
+/* datagrams are split at line boundaries to stay below this size */
+#define DGRAM_MAX 4096
+
+typedef enum {
+  SINK_STDOUT,
+  SINK_FILE,
+  SINK_UNIX,
+  SINK_DGRAM
+} sink_type_t;
+
+typedef enum {
+  POLICY_EXIT,
+  POLICY_DROP
+} policy_t;
+
+struct sink {
+  sink_type_t type;
+  policy_t policy;
+  char *path;
+
+  int fd;
+  long long retry_ms;
+
+  /* rotation of file sinks */
+  size_t rotate, keep, written;
+
+  /* output which could not be written yet */
+  char *pending;
+  size_t pending_len, buffer_size;
+
+  unsigned long dropped;
+};
+
+struct output {
+  char const *progname;
+
+  struct sink *sinks;
+  size_t nsinks;
+
+  char *buf;
+  size_t len, size;
+};
+
+static void
+sink_fail(struct output *out, struct sink *sink, char const *what, int err)
+{
+  if (sink->policy == POLICY_EXIT) {
+    if (sink->type == SINK_STDOUT)
+      exit(EX_IOERR);
+
+    fail("%s: failed to %s '%s': %s\n", out->progname, what, sink->path,
+         strerror(err));
+  }
+
+  if (sink->type == SINK_STDOUT)
+    warn("%s: failed to %s stdout: %s, dropping its output\n", out->progname,
+         what, strerror(err));
+  else
+    warn("%s: failed to %s '%s': %s, retrying in %d ms\n", out->progname,
+         what, sink->path, strerror(err), RETRY_MS);
+
+  if (sink->fd > -1 && sink->type != SINK_STDOUT)
+    close(sink->fd);
+
+  sink->fd = -1;
+  sink->pending_len = 0;
+  sink->retry_ms = now_ms() + RETRY_MS;
+}
+
+static int
+sink_connect(struct sink *sink, int type)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) +
+                       strlen(sink->path);
+  int fd;
+
+  if (strlen(sink->path) >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memcpy(addr.sun_path, sink->path, strlen(sink->path));
+
+  /* '@NAME' is NAME in the abstract namespace */
+  if (sink->path[0] == '@')
+    addr.sun_path[0] = '\0';
+  else
+    addr_len++;
+
+  if ((fd = socket(AF_UNIX, type, 0)) == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, addr_len) == -1 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    int err = errno;
+
+    close(fd);
+    errno = err;
+
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+sink_open(struct output *out, struct sink *sink)
+{
+  struct stat st;
+
+  switch (sink->type) {
+    case SINK_STDOUT:
+      /* never reopened */
+      return;
+
+    case SINK_FILE:
+      sink->fd = open(sink->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      0644);
+      if (sink->fd > -1)
+        sink->written = fstat(sink->fd, &st) == 0 ? st.st_size : 0;
+      break;
+
+    case SINK_UNIX:
+      sink->fd = sink_connect(sink, SOCK_STREAM);
+      break;
+
+    case SINK_DGRAM:
+      sink->fd = sink_connect(sink, SOCK_DGRAM);
+      break;
+  }
+
+  if (sink->fd == -1)
+    sink_fail(out, sink, "open", errno);
+}
+
+/* PATH.(keep - 1) -> PATH.keep, ..., PATH -> PATH.1 */
+static void
+sink_rotate(struct output *out, struct sink *sink)
+{
+  size_t path_len = strlen(sink->path) + 24;
+  char from[path_len], to[path_len];
+
+  close(sink->fd);
+
+  for (size_t idx = sink->keep; idx > 0; idx--) {
+    if (idx > 1)
+      snprintf(from, path_len, "%s.%zu", sink->path, idx - 1);
+    else
+      snprintf(from, path_len, "%s", sink->path);
+    snprintf(to, path_len, "%s.%zu", sink->path, idx);
+
+    rename(from, to);
+  }
+
+  if (sink->keep == 0)
+    unlink(sink->path);
+
+  sink_open(out, sink);
+}
+
+static void
+sink_write_dgram(struct output *out, struct sink *sink, char const *buf,
+                 size_t len)
+{
+  while (sink->fd > -1 && len > 0) {
+    size_t chunk = len;
+    ssize_t ret;
+
+    /* split after the last complete line which fits */
+    if (chunk > DGRAM_MAX) {
+      chunk = DGRAM_MAX;
+      while (chunk > 0 && buf[chunk - 1] != '\n')
+        chunk--;
+      if (chunk == 0)
+        chunk = DGRAM_MAX;
+    }
+
+    STATS_SYSCALL(SYSCALL_SEND);
+    ret = send(sink->fd, buf, chunk, 0);
+
+    if (ret == -1 && errno == EINTR)
+      continue;
+    else if (ret == -1 && (errno == EAGAIN || errno == ENOBUFS ||
+                           errno == ECONNREFUSED))
+      sink->dropped += chunk; /* no reader or reader too slow */
+    else if (ret == -1)
+      sink_fail(out, sink, "write to", errno);
+    else
+      STATS_ADD(bytes_written, ret);
+
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+static void
+sink_write(struct output *out, struct sink *sink, char const *buf, size_t len)
+{
+  if (sink->fd == -1) {
+    if (sink->type == SINK_STDOUT || now_ms() < sink->retry_ms) {
+      sink->dropped += len;
+      return;
+    }
+
+    sink_open(out, sink);
+
+    if (sink->fd == -1) {
+      sink->dropped += len;
+      return;
+    }
+  }
+
+  if (sink->type == SINK_DGRAM) {
+    sink_write_dgram(out, sink, buf, len);
+    return;
+  }
+
+  /* keep order behind output which could not be written before */
+  if (sink->pending_len > 0) {
+    if (sink->pending_len + len > sink->buffer_size) {
+      sink->dropped += len;
+      len = 0;
+    } else {
+      memcpy(sink->pending + sink->pending_len, buf, len);
+      sink->pending_len += len;
+    }
+
+    buf = sink->pending;
+    len = sink->pending_len;
+  }
+
+  if (sink->rotate && sink->written > 0 && sink->written + len > sink->rotate)
+    sink_rotate(out, sink);
+
+  while (sink->fd > -1 && len > 0) {
+    ssize_t ret;
+
+    STATS_SYSCALL(SYSCALL_WRITE);
+    ret = write(sink->fd, buf, len);
+
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && errno == EAGAIN) {
+      if (buf != sink->pending) {
+        if (len > sink->buffer_size) {
+          sink->dropped += len;
+          len = 0;
+        } else {
+          memcpy(sink->pending, buf, len);
+        }
+      } else {
+        memmove(sink->pending, buf, len);
+      }
+      sink->pending_len = len;
+
+      return;
+    } else if (ret == -1) {
+      sink_fail(out, sink, "write to", errno);
+      return;
+    }
+
+    STATS_ADD(bytes_written, ret);
+    sink->written += ret;
+    buf += ret;
+    len -= ret;
+  }
+
+  sink->pending_len = 0;
+}
+
+struct output *
+output_new(char const *progname)
+{
+  struct output *out = calloc(1, sizeof *out);
+
+  if (out == NULL)
+    fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+  out->progname = progname;
+
+  return out;
+}
+
+void
+output_free(struct output *out)
+{
+  for (size_t idx = 0; idx < out->nsinks; idx++) {
+    struct sink *sink = &out->sinks[idx];
+
+    if (sink->fd > -1 && sink->type != SINK_STDOUT)
+      close(sink->fd);
+
+    free(sink->path);
+    free(sink->pending);
+  }
+
+  free(out->sinks);
+  free(out->buf);
+  free(out);
+}
+
+static size_t
+parse_size(struct output *out, char const *spec, char const *value)
+{
+  char *end;
+  unsigned long size = strtoul(value, &end, 10);
+
+  if (end == value || *end != '\0')
+    fail("%s: invalid number '%s' in output '%s'\n", out->progname, value,
+         spec);
+
+  return size;
+}
+
+void
+output_add(struct output *out, char const *spec)
+{
+  struct sink *sinks, *sink;
+  char *settings, *setting, *save;
+  struct {
+    char const *prefix;
+    sink_type_t type;
+    policy_t policy;
+  } types[] = {
+    { "file:", SINK_FILE, POLICY_EXIT },
+    { "unix:", SINK_UNIX, POLICY_DROP },
+    { "dgram:", SINK_DGRAM, POLICY_DROP },
+  };
+
+  if ((sinks = realloc(out->sinks, (out->nsinks + 1) * sizeof *sinks))
+      == NULL)
+    fail("%s: failed to allocate memory: %s\n", out->progname,
+         strerror(errno));
+
+  out->sinks = sinks;
+  sink = &out->sinks[out->nsinks++];
+  *sink = (struct sink){ .type = SINK_STDOUT, .policy = POLICY_EXIT,
+                         .fd = STDOUT_FILENO, .keep = 1,
+                         .buffer_size = DEFAULT_BUFFER_SIZE };
+
+  if ((settings = strdup(spec)) == NULL)
+    fail("%s: failed to allocate memory: %s\n", out->progname,
+         strerror(errno));
+
+  setting = strtok_r(settings, ",", &save);
+
+  if (setting == NULL) {
+    fail("%s: invalid output '%s'\n", out->progname, spec);
+  } else if (strcmp(setting, "-") == 0 || strcmp(setting, "stdout") == 0) {
+    sink->path = strdup("stdout");
+  } else {
+    size_t idx;
+
+    for (idx = 0; idx < ARRLEN(types); idx++) {
+      size_t prefix_len = strlen(types[idx].prefix);
+
+      if (strncmp(setting, types[idx].prefix, prefix_len) == 0 &&
+          setting[prefix_len] != '\0') {
+        sink->type = types[idx].type;
+        sink->policy = types[idx].policy;
+        sink->path = strdup(setting + prefix_len);
+        break;
+      }
+    }
+
+    if (idx == ARRLEN(types))
+      fail("%s: invalid output '%s', use the '-h'/'--help' option to "
+           "display the help message\n", out->progname, spec);
+  }
+
+  while ((setting = strtok_r(NULL, ",", &save)) != NULL) {
+    char *value = strchr(setting, '=');
+
+    if (value == NULL)
+      fail("%s: invalid setting '%s' in output '%s'\n", out->progname,
+           setting, spec);
+    *value++ = '\0';
+
+    if (strcmp(setting, "policy") == 0 && strcmp(value, "exit") == 0)
+      sink->policy = POLICY_EXIT;
+    else if (strcmp(setting, "policy") == 0 && strcmp(value, "drop") == 0)
+      sink->policy = POLICY_DROP;
+    else if (strcmp(setting, "buffer") == 0)
+      sink->buffer_size = parse_size(out, spec, value);
+    else if (strcmp(setting, "rotate") == 0 && sink->type == SINK_FILE)
+      sink->rotate = parse_size(out, spec, value);
+    else if (strcmp(setting, "keep") == 0 && sink->type == SINK_FILE)
+      sink->keep = parse_size(out, spec, value);
+    else
+      fail("%s: invalid setting '%s=%s' in output '%s'\n", out->progname,
+           setting, value, spec);
+  }
+
+  free(settings);
+
+  if (sink->path == NULL ||
+      (sink->buffer_size && (sink->pending = malloc(sink->buffer_size))
+       == NULL))
+    fail("%s: failed to allocate memory: %s\n", out->progname,
+         strerror(errno));
+
+  /* a closed reader of any sink, a pipe on stdout or a fifo as much as a
+   * socket, shows up as EPIPE and is handled by the policy
+   */
+  signal(SIGPIPE, SIG_IGN);
+
+  sink->fd = sink->type == SINK_STDOUT ? STDOUT_FILENO : -1;
+  sink_open(out, sink);
+}
+
+bool
+output_has_stdout(struct output *out)
+{
+  for (size_t idx = 0; idx < out->nsinks; idx++) {
+    if (out->sinks[idx].type == SINK_STDOUT && out->sinks[idx].fd > -1)
+      return true;
+  }
+
+  return false;
+}
+
+void
+output_stdout_error(struct output *out)
+{
+  for (size_t idx = 0; idx < out->nsinks; idx++) {
+    if (out->sinks[idx].type == SINK_STDOUT && out->sinks[idx].fd > -1)
+      sink_fail(out, &out->sinks[idx], "write to", EPIPE);
+  }
+}
+
+void
+output_append(struct output *out, char const *buf, size_t len)
+{
+  if (out->len + len > out->size) {
+    size_t size = (out->len + len) * 2;
+    char *new_buf = realloc(out->buf, size);
+
+    if (new_buf == NULL)
+      fail("%s: failed to allocate memory: %s\n", out->progname,
+           strerror(errno));
+
+    out->buf = new_buf;
+    out->size = size;
+  }
+
+  memcpy(out->buf + out->len, buf, len);
+  out->len += len;
+}
+
+void
+output_flush(struct output *out)
+{
+  if (out->len == 0)
+    return;
+
+  for (size_t idx = 0; idx < out->nsinks; idx++)
+    sink_write(out, &out->sinks[idx], out->buf, out->len);
+
+  out->len = 0;
+}
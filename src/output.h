@@ -0,0 +1,46 @@
+#ifndef _OUTPUT_HDR_
+#define _OUTPUT_HDR_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Fan-out of the formatted events to several sinks. Events are appended to
+ * one shared buffer, which output_flush() writes to every sink.
+ *
+ * Sink specifications, optionally followed by ',key=value' settings:
+ *   '-' or 'stdout'
+ *   'file:PATH'    appended to, 'rotate=BYTES' and 'keep=N' rotate it
+ *   'unix:PATH'    unix stream socket to connect to
+ *   'dgram:PATH'   unix datagram socket, '@NAME' for the abstract namespace
+ * Every sink takes 'policy=exit' or 'policy=drop', what to do when writing
+ * fails, and 'buffer=BYTES', how much unwritten output to keep.
+ */
+
+struct output;
+
+struct output *
+output_new(char const *progname);
+
+void
+output_free(struct output *out);
+
+/* parses the sink specification, fails on invalid ones */
+void
+output_add(struct output *out, char const *spec);
+
+bool
+output_has_stdout(struct output *out);
+
+/* applies the failure policy of the stdout sink after POLLERR */
+void
+output_stdout_error(struct output *out);
+
+/* appends to the shared buffer */
+void
+output_append(struct output *out, char const *buf, size_t len);
+
+/* writes the shared buffer to every sink and empties it */
+void
+output_flush(struct output *out);
+
+#endif /* #ifndef _OUTPUT_HDR_ */
@@ -0,0 +1,229 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "options.h"
+#include "util.h"
+#include "spm.h"
+
+#include "commands.h"
+
+#define DISPATCH_EVENTS 64
+/* BTN_0 to BTN_9 followed by BTN_TRIGGER_HAPPY1 to BTN_TRIGGER_HAPPY40 */
+#define MAX_BUTTONS 50
+/* input events buffered per virtual device before they are written */
+#define BUF_EVENTS 128
+/* phys of the virtual devices, which the proxy must not read itself */
+#define PROXY_PHYS "spm-proxy"
+
+static int const axis_codes[6] = {
+  REL_X, REL_Y, REL_Z, REL_RX, REL_RY, REL_RZ
+};
+
+struct proxy_device {
+  int fd;
+
+  struct input_event buf[BUF_EVENTS];
+  size_t len;
+
+  struct proxy_device *next;
+};
+
+static int
+button_code(int bnum)
+{
+  return bnum < 10 ? BTN_0 + bnum : BTN_TRIGGER_HAPPY1 + bnum - 10;
+}
+
+static struct proxy_device *
+proxy_device_create(char const *progname, struct spacemouse *mouse)
+{
+  struct proxy_device *dev = calloc(1, sizeof *dev);
+  struct uinput_setup setup = { .id = { BUS_VIRTUAL, 0, 0, 1 } };
+  int err = 0;
+
+  if (dev == NULL)
+    fail("%s: failed to allocate memory: %s\n", progname, strerror(errno));
+
+  /* 6DoF drivers like spacenavd identify devices by vendor and product */
+  if (ioctl(spacemouse_device_get_fd(mouse), EVIOCGID, &setup.id) == -1)
+    goto error;
+
+  if ((dev->fd = open("/dev/uinput", O_WRONLY)) == -1)
+    goto error;
+
+  err |= ioctl(dev->fd, UI_SET_PHYS, PROXY_PHYS);
+
+  err |= ioctl(dev->fd, UI_SET_EVBIT, EV_REL);
+  for (int idx = 0; idx < 6; idx++)
+    err |= ioctl(dev->fd, UI_SET_RELBIT, axis_codes[idx]);
+
+  err |= ioctl(dev->fd, UI_SET_EVBIT, EV_KEY);
+  for (int bnum = 0; bnum < MAX_BUTTONS; bnum++)
+    err |= ioctl(dev->fd, UI_SET_KEYBIT, button_code(bnum));
+
+  err |= ioctl(dev->fd, UI_SET_EVBIT, EV_LED);
+  err |= ioctl(dev->fd, UI_SET_LEDBIT, LED_MISC);
+
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "spm proxy %s %s",
+           spacemouse_device_get_manufacturer(mouse),
+           spacemouse_device_get_product(mouse));
+
+  if (err || ioctl(dev->fd, UI_DEV_SETUP, &setup) == -1 ||
+      ioctl(dev->fd, UI_DEV_CREATE) == -1)
+    goto error;
+
+  return dev;
+
+error:
+  fail("%s: failed to create virtual device for '%s': %s\n", progname,
+       spacemouse_device_get_devnode(mouse), strerror(errno));
+
+  return NULL;
+}
+
+static void
+proxy_device_flush(char const *progname, struct proxy_device *dev)
+{
+  if (dev->len > 0 &&
+      write(dev->fd, dev->buf, dev->len * sizeof *dev->buf) == -1)
+    warn("%s: failed to write to virtual device: %s\n", progname,
+         strerror(errno));
+
+  dev->len = 0;
+}
+
+/* appends one frame of events terminated by EV_SYN, frames are never split */
+static void
+proxy_device_frame(char const *progname, struct proxy_device *dev,
+                   struct input_event const *events, size_t nevents)
+{
+  if (nevents == 0)
+    return;
+
+  if (dev->len + nevents + 1 > BUF_EVENTS)
+    proxy_device_flush(progname, dev);
+
+  memcpy(dev->buf + dev->len, events, nevents * sizeof *events);
+  dev->len += nevents;
+  dev->buf[dev->len++] = (struct input_event){ .type = EV_SYN,
+                                               .code = SYN_REPORT };
+}
+
+static void
+proxy_device_destroy(struct proxy_device *dev)
+{
+  ioctl(dev->fd, UI_DEV_DESTROY);
+  close(dev->fd);
+  free(dev);
+}
+
+int
+proxy_command(char const *progname, options_t *options, int nargs, char **args)
+{
+  struct spm_context *ctx;
+  struct spm_config config = {
+    .match = { options->match.ignore_case, options->match.device,
+               options->match.manufacturer, options->match.product },
+    .grab = true,
+    .deviation = options->deviation,
+    .raw_motion = true,
+    .report_present = true,
+    .exclude_phys = PROXY_PHYS
+  };
+  struct proxy_device *devices = NULL;
+  int err;
+
+  if (nargs)
+    fail("%s: invalid non-command or non-option argument(s), use the "
+         "'-h'/'--help' option to display the help message\n", progname);
+
+  if ((err = spm_new(&config, &ctx)) == -EINVAL)
+    fail("%s: failed to use regex, please use valid ERE\n", progname);
+  else if (err < 0)
+    fail("%s: failed to initialize devices: %s\n", progname, strerror(-err));
+
+  while (true) {
+    spm_event_t events[DISPATCH_EVENTS];
+    int nevents = spm_dispatch(ctx, events, ARRLEN(events), -1);
+
+    if (nevents < 0)
+      fail("%s: spm_dispatch() failed: %s\n", progname, strerror(-nevents));
+
+    for (int idx = 0; idx < nevents; idx++) {
+      spm_event_t *event = &events[idx];
+      struct spacemouse *mouse = event->any.mouse;
+      struct proxy_device *dev = spm_device_get_data(mouse);
+      struct input_event frame[6];
+      size_t nframe = 0;
+
+      switch (event->type) {
+        case SPM_EVENT_ERROR: {
+          char line[256];
+
+          spm_event_format(event, line, sizeof line);
+          fail("%s: %s", progname, line + strlen("error: "));
+          break;
+        }
+
+        case SPM_EVENT_DEVICE:
+          if (event->device.connect) {
+            dev = proxy_device_create(progname, mouse);
+            dev->next = devices;
+            devices = dev;
+            spm_device_set_data(mouse, dev);
+          } else if ((dev = event->device.data) != NULL) {
+            struct proxy_device **iter = &devices;
+
+            while (*iter != dev)
+              iter = &(*iter)->next;
+            *iter = dev->next;
+
+            proxy_device_destroy(dev);
+          }
+          break;
+
+        case SPM_EVENT_RAW_MOTION:
+          for (int axis = 0; axis < 6; axis++) {
+            if (event->raw_motion.axis[axis] != 0)
+              frame[nframe++] = (struct input_event){
+                .type = EV_REL, .code = axis_codes[axis],
+                .value = event->raw_motion.axis[axis]
+              };
+          }
+          break;
+
+        case SPM_EVENT_BUTTON:
+          if (event->button.bnum >= 0 && event->button.bnum < MAX_BUTTONS)
+            frame[nframe++] = (struct input_event){
+              .type = EV_KEY, .code = button_code(event->button.bnum),
+              .value = event->button.press
+            };
+          break;
+
+        case SPM_EVENT_LED:
+          frame[nframe++] = (struct input_event){
+            .type = EV_LED, .code = LED_MISC, .value = event->led.state
+          };
+          break;
+      }
+
+      if (dev != NULL && event->type != SPM_EVENT_DEVICE)
+        proxy_device_frame(progname, dev, frame, nframe);
+    }
+
+    /* one write per virtual device and batch */
+    for (struct proxy_device *dev = devices; dev != NULL; dev = dev->next)
+      proxy_device_flush(progname, dev);
+  }
+
+  return EXIT_SUCCESS;
+}
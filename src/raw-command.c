@@ -10,6 +10,7 @@
 
 #include "options.h"
 #include "util.h"
+#include "stats.h"
 
 #include "commands.h"
 
@@ -23,14 +24,24 @@ raw_command(char const *progname, options_t *options, int nargs, char **args)
     fail("%s: invalid non-command or non-option argument(s), use the "
          "'-h'/'--help' option to display the help message\n", progname);
 
-  /* TODO: add error check */
-  monitor_fd = spacemouse_monitor_open();
+  /* Opened before listing, so devices connected meanwhile are reported by
+   * the monitor, which skips those found open already.
+   */
+  if ((monitor_fd = spacemouse_monitor_open()) < 0)
+    fail("%s: failed to open device monitor: %s\n", progname,
+         strerror(-monitor_fd));
+
+  STATS_TIME_START(enumeration_start);
 
   if ((err = spacemouse_device_list(&head, 1)) != 0) {
     /* TODO: better message */
     fail("%s: spacemouse_device_list() returned error '%d'\n", progname, err);
   }
 
+  STATS_TIME_ADD(enumeration_ns, enumeration_start);
+
+  stats_install_signal();
+
   if (head == NULL)
     printf("No devices connected.\n");
 
@@ -75,16 +86,31 @@ raw_command(char const *progname, options_t *options, int nargs, char **args)
           max_fd = mouse_fd;
       }
 
-    if (select(max_fd + 1, &fds, NULL, NULL, NULL) == -1)
-      fail("%s: select() error: %s", progname, strerror(errno));
+    STATS_SYSCALL(SYSCALL_SELECT);
+    if (select(max_fd + 1, &fds, NULL, NULL, NULL) == -1) {
+      if (errno != EINTR)
+        fail("%s: select() error: %s", progname, strerror(errno));
+
+      FD_ZERO(&fds);
+    }
+
+    STATS_INC(wakeups);
+
+    stats_poll(options->stats_fd);
 
     if (FD_ISSET(monitor_fd, &fds)) {
       struct spacemouse *mon_mouse;
+      STATS_TIME_START(hotplug_start);
 
       int action = spacemouse_monitor(&mon_mouse);
 
       int match = match_device(mon_mouse, &options->match);
 
+      /* already open if it was connected while listing */
+      if (action == SPACEMOUSE_ACTION_ADD &&
+          spacemouse_device_get_fd(mon_mouse) > -1)
+        match = 0;
+
       if (match) {
         if (action == SPACEMOUSE_ACTION_ADD) {
           printf("Device added, ");
@@ -109,6 +135,8 @@ raw_command(char const *progname, options_t *options, int nargs, char **args)
           printf("  product: %s\n", spacemouse_device_get_product(mon_mouse));
         }
       }
+
+      STATS_TIME_ADD(hotplug_ns, hotplug_start);
     }
 
     spacemouse_device_list_foreach(iter, head) {
@@ -116,12 +144,19 @@ raw_command(char const *progname, options_t *options, int nargs, char **args)
 
       if (mouse_fd > -1 && FD_ISSET(mouse_fd, &fds)) {
         spacemouse_event_t mouse_event = { 0 };
-        int read_event = spacemouse_device_read_event(iter, &mouse_event);
+        int read_event;
+
+        STATS_SYSCALL(SYSCALL_READ);
+        read_event = spacemouse_device_read_event(iter, &mouse_event);
 
         if (read_event < 0) {
           /* No need to handle error, monitor should handle removes */
           spacemouse_device_close(iter);
         } else if (read_event == SPACEMOUSE_READ_SUCCESS) {
+          STATS_INC(events_read);
+          STATS_INC(events_emitted);
+          STATS_DEVICE_EVENT(spacemouse_device_get_id(iter));
+
           /* Safe guard for new events which we don't know how to handle. */
           if (mouse_event.type > -1 &&
               mouse_event.type <= SPACEMOUSE_EVENT_LED)
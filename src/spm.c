@@ -0,0 +1,1492 @@
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <regex.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/input.h>
+
+#include <libspacemouse.h>
+
+#include "spm.h"
+#include "stats.h"
+
+/* maximum number of ready fds handled in one dispatch round */
+#define MAX_BATCH 64
+/* events a worker queues before it waits for the merge stage */
+#define MAX_SHARD_QUEUE 4096
+
+/* calibrated deviations are the noise mean plus NOISE_SIGMAS standard
+ * deviations within these bounds, the lower one unless given as deviation
+ */
+#define NOISE_SIGMAS 4
+#define MIN_CALIBRATED_DEVIATION 32
+#define MAX_CALIBRATED_DEVIATION (2 * SPM_MIN_DEVIATION)
+/* weight of an idle sample when adapting after the calibration */
+#define NOISE_ADAPT_WEIGHT (1.0 / 1024)
+/* After the calibration only reports with every axis within REST_SIGMAS
+ * standard deviations of its mean adapt the noise, so pressure just below
+ * the deviation does not raise it. The variance of noise cut off there is
+ * REST_VARIANCE of the full one.
+ */
+#define REST_SIGMAS 2
+#define REST_VARIANCE 0.7737
+
+/* repeats of an EV_REL device stop after this many report periods without a
+ * report, the period being the shortest seen and at most the default
+ */
+#define REL_RELEASE_PERIODS 4
+#define REL_DEFAULT_PERIOD 16000000LL /* nanoseconds */
+
+struct shard;
+
+struct device_state {
+  struct spacemouse *mouse;
+  struct shard *shard;
+  bool closed; /* waiting for shard_reap(), ready epoll events may remain */
+
+  int deviation[6];
+  int axis_cond[6];
+  bool idle; /* last raw motion event had all axes zeroed */
+
+  /* noise at rest with config.calibrate, noise_m2 is Welford's sum of
+   * squares while calibrating and the variance once calibrated
+   */
+  int noise_samples;
+  double noise_mean[6], noise_m2[6];
+
+  /* timer driven repeats, direction is 0 for axes within the deviation,
+   * delayed while the first event waits for config.milliseconds to pass
+   */
+  int repeat_direction[6];
+  bool repeat_delayed[6];
+  long long repeat_deadline[6], repeat_interval[6]; /* nanoseconds */
+
+  /* EV_REL devices, which send no report when the cap is released */
+  bool relative;
+  long long last_report, report_period; /* nanoseconds */
+
+  void *data;
+
+  struct device_state *prev, *next;
+};
+
+struct queued_event {
+  spm_event_t event;
+  long long time; /* only set for an ordered merge */
+};
+
+/* events produced but not yet delivered */
+struct queue {
+  struct queued_event *events;
+  size_t head, len, size;
+};
+
+/* A set of devices with their own epoll set, repeat timer and queue. Without
+ * threads the context has a single shard, handled by spm_dispatch() using the
+ * context's epoll set, otherwise each shard has a worker thread and every
+ * member is guarded by lock.
+ */
+struct shard {
+  struct spm_context *ctx;
+
+  int epoll_fd;
+  int timer_fd; /* one timer for the repeats of all devices of the shard */
+
+  struct device_state *devices, *closed;
+  int ndevices;
+
+  struct queue queue;
+
+  pthread_t thread;
+  bool started, stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t merged;
+  int cpu; /* -1 when not pinned */
+  char name[sizeof "shard -2147483648"];
+};
+
+struct spm_context {
+  struct spm_config config;
+  int min_deviation; /* lower bound of calibrated deviations */
+
+  regex_t regex[3];
+  bool has_regex[3];
+
+  int epoll_fd;
+  int monitor_fd;
+
+  struct shard *shards;
+  int nshards;
+
+  /* worker threads only: wake_fd signals the merge stage of spm_dispatch(),
+   * stop_fd stays readable once the workers are to exit
+   */
+  bool threaded;
+  int wake_fd, stop_fd;
+  struct queue merged;
+
+  /* readable while delivered events are left over for the next call */
+  int pending_fd;
+  bool pending;
+
+  spm_callback_t callback;
+  void *callback_data;
+};
+
+static char const *axis_str[6][2] = {
+  { "right", "left" },
+  { "back", "forward" },
+  { "down", "up" },
+  { "pitch back", "pitch forward" },
+  { "roll left", "roll right" },
+  { "yaw right", "yaw left" },
+};
+
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool
+queue_empty(struct queue const *queue)
+{
+  return queue->head == queue->len;
+}
+
+static int
+queue_append(struct queue *queue, struct queued_event const *queued)
+{
+  if (queue->len == queue->size) {
+    if (queue->head > 0) {
+      memmove(queue->events, queue->events + queue->head,
+              (queue->len - queue->head) * sizeof *queue->events);
+      queue->len -= queue->head;
+      queue->head = 0;
+    } else {
+      size_t size = queue->size ? queue->size * 2 : MAX_BATCH;
+      struct queued_event *events = realloc(queue->events,
+                                            size * sizeof *events);
+
+      if (events == NULL)
+        return -ENOMEM;
+
+      queue->events = events;
+      queue->size = size;
+    }
+  }
+
+  queue->events[queue->len++] = *queued;
+
+  return 0;
+}
+
+static int
+queue_push(struct shard *shard, spm_event_t const *event)
+{
+  struct queued_event queued = { *event, 0 };
+
+  if (shard->ctx->config.ordered)
+    queued.time = now_ns();
+
+  STATS_INC(events_emitted);
+
+  return queue_append(&shard->queue, &queued);
+}
+
+static void
+shard_lock(struct shard *shard)
+{
+  if (shard->ctx->threaded)
+    pthread_mutex_lock(&shard->lock);
+}
+
+static void
+shard_unlock(struct shard *shard)
+{
+  if (shard->ctx->threaded)
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* in index order, the merge stage and device removal need every shard */
+static void
+lock_all(struct spm_context *ctx)
+{
+  for (int idx = 0; idx < ctx->nshards; idx++)
+    shard_lock(&ctx->shards[idx]);
+}
+
+static void
+unlock_all(struct spm_context *ctx)
+{
+  for (int idx = ctx->nshards - 1; idx >= 0; idx--)
+    shard_unlock(&ctx->shards[idx]);
+}
+
+/* true if the device's phys in sysfs is config.exclude_phys */
+static bool
+excluded(struct spm_context *ctx, struct spacemouse *mouse)
+{
+  char const *devnode = spacemouse_device_get_devnode(mouse);
+  char const *name = strrchr(devnode, '/');
+  char path[128], phys[64] = "";
+  size_t len;
+  FILE *file;
+
+  if (ctx->config.exclude_phys == NULL || name == NULL)
+    return false;
+
+  snprintf(path, sizeof path, "/sys/class/input/%s/device/phys", name + 1);
+  if ((file = fopen(path, "r")) == NULL)
+    return false;
+
+  if (fgets(phys, sizeof phys, file) != NULL &&
+      (len = strlen(phys)) > 0 && phys[len - 1] == '\n')
+    phys[len - 1] = '\0';
+  fclose(file);
+
+  return strcmp(phys, ctx->config.exclude_phys) == 0;
+}
+
+static bool
+match(struct spm_context *ctx, struct spacemouse *mouse)
+{
+  char const *members[] = { spacemouse_device_get_devnode(mouse),
+                            spacemouse_device_get_manufacturer(mouse),
+                            spacemouse_device_get_product(mouse) };
+
+  for (size_t idx = 0; idx < 3; idx++) {
+    if (ctx->has_regex[idx] &&
+        regexec(&ctx->regex[idx], members[idx], 0, NULL, 0) != 0)
+      return false;
+  }
+
+  return !excluded(ctx, mouse);
+}
+
+static void
+device_error(struct shard *shard, struct spacemouse *mouse,
+             char const *operation, int err)
+{
+  spm_event_t event = { .error = { SPM_EVENT_ERROR, mouse, operation, err } };
+
+  queue_push(shard, &event);
+}
+
+/* Masks the evdev event types which are not wanted in the kernel, so they
+ * do not even wake us up. Returns false if the kernel does not support
+ * EVIOCSMASK (before Linux 4.4), handle_device() drops them then.
+ */
+static bool
+device_mask(struct spm_context *ctx, struct spacemouse *mouse)
+{
+#ifdef EVIOCSMASK
+  /* type 0 selects the mask of event types, EV_CNT bits fit in 32 */
+  unsigned long types = 1UL << EV_SYN;
+  struct input_mask mask = { .type = 0, .codes_size = sizeof types,
+                             .codes_ptr = (uintptr_t)&types };
+
+  if (ctx->config.types & SPM_TYPE_MOTION)
+    types |= 1UL << EV_REL | 1UL << EV_ABS;
+  if (ctx->config.types & SPM_TYPE_BUTTON)
+    types |= 1UL << EV_KEY;
+  if (ctx->config.types & SPM_TYPE_LED)
+    types |= 1UL << EV_LED;
+
+  STATS_SYSCALL(SYSCALL_IOCTL);
+  return ioctl(spacemouse_device_get_fd(mouse), EVIOCSMASK, &mask) == 0;
+#else
+  return false;
+#endif
+}
+
+/* returns true if the device matched and was opened */
+static bool
+device_init(struct shard *shard, struct spacemouse *mouse)
+{
+  struct spm_context *ctx = shard->ctx;
+  struct device_state *state;
+  struct epoll_event ep_event = { .events = EPOLLIN };
+  int err;
+
+  if (!match(ctx, mouse))
+    return false;
+
+  if ((state = calloc(1, sizeof *state)) == NULL) {
+    device_error(shard, mouse, "open", -ENOMEM);
+    return false;
+  }
+
+  if ((err = spacemouse_device_open(mouse)) < 0) {
+    free(state);
+    device_error(shard, mouse, "open", err);
+    return false;
+  }
+
+  spacemouse_device_set_data(mouse, state);
+
+  state->mouse = mouse;
+  state->shard = shard;
+  for (int idx = 0; idx < 6; idx++)
+    state->deviation[idx] = ctx->config.deviation;
+  state->next = shard->devices;
+  if (shard->devices != NULL)
+    shard->devices->prev = state;
+  shard->devices = state;
+  shard->ndevices++;
+
+  if (ctx->config.grab) {
+    STATS_SYSCALL(SYSCALL_IOCTL);
+    if ((err = spacemouse_device_set_grab(mouse, 1)) < 0)
+      device_error(shard, mouse, "grab", err);
+  }
+
+  if (ctx->config.repeat != 0) {
+    unsigned long types = 0;
+
+    STATS_SYSCALL(SYSCALL_IOCTL);
+    if (ioctl(spacemouse_device_get_fd(mouse), EVIOCGBIT(0, sizeof types),
+              &types) >= 0)
+      state->relative = (types >> EV_REL & 1) && !(types >> EV_ABS & 1);
+
+    state->report_period = REL_DEFAULT_PERIOD;
+  }
+
+  if (ctx->config.types != 0) {
+    if (device_mask(ctx, mouse))
+      STATS_INC(masks_kernel);
+    else
+      STATS_INC(masks_user);
+  }
+
+  ep_event.data.ptr = state;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD,
+                spacemouse_device_get_fd(mouse), &ep_event) == -1)
+    device_error(shard, mouse, "open", -errno);
+
+  return true;
+}
+
+static void
+device_close(struct shard *shard, struct spacemouse *mouse)
+{
+  struct device_state *state = spacemouse_device_get_data(mouse);
+
+  epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, spacemouse_device_get_fd(mouse),
+            NULL);
+
+  if (state->prev != NULL)
+    state->prev->next = state->next;
+  else
+    shard->devices = state->next;
+  if (state->next != NULL)
+    state->next->prev = state->prev;
+  shard->ndevices--;
+
+  /* freed by shard_reap() once no ready event can refer to it anymore */
+  state->closed = true;
+  state->next = shard->closed;
+  shard->closed = state;
+  spacemouse_device_set_data(mouse, NULL);
+
+  if (shard->ctx->config.grab)
+    spacemouse_device_set_grab(mouse, 0);
+
+  spacemouse_device_close(mouse);
+}
+
+static void
+shard_reap(struct shard *shard)
+{
+  while (shard->closed != NULL) {
+    struct device_state *state = shard->closed;
+
+    shard->closed = state->next;
+    free(state);
+  }
+}
+
+static void
+device_event(struct shard *shard, struct spacemouse *mouse, bool connect)
+{
+  spm_event_t event = { .device = { SPM_EVENT_DEVICE, mouse, connect,
+                                    spm_device_get_data(mouse) } };
+
+  queue_push(shard, &event);
+}
+
+/* hotplugged devices go to the shard with the fewest devices */
+static struct shard *
+least_loaded(struct spm_context *ctx)
+{
+  struct shard *best = &ctx->shards[0];
+  int best_ndevices = -1;
+
+  for (int idx = 0; idx < ctx->nshards; idx++) {
+    struct shard *shard = &ctx->shards[idx];
+    int ndevices;
+
+    shard_lock(shard);
+    ndevices = shard->ndevices;
+    shard_unlock(shard);
+
+    if (best_ndevices == -1 || ndevices < best_ndevices) {
+      best = shard;
+      best_ndevices = ndevices;
+    }
+  }
+
+  return best;
+}
+
+static void
+handle_monitor(struct spm_context *ctx)
+{
+  struct spacemouse *mouse;
+  struct shard *shard;
+  STATS_TIME_START(start);
+  int action = spacemouse_monitor(&mouse);
+
+  /* opened already if it was connected while spm_new() listed the devices */
+  if (action == SPACEMOUSE_ACTION_ADD && spacemouse_device_get_fd(mouse) < 0) {
+    shard = least_loaded(ctx);
+
+    shard_lock(shard);
+    if (device_init(shard, mouse))
+      device_event(shard, mouse, true);
+    shard_unlock(shard);
+  } else if (action == SPACEMOUSE_ACTION_REMOVE) {
+    struct device_state *state;
+
+    /* the owning worker may close the device meanwhile */
+    lock_all(ctx);
+    if (spacemouse_device_get_fd(mouse) > -1 &&
+        (state = spacemouse_device_get_data(mouse)) != NULL) {
+      /* queued behind the remaining events of the device */
+      device_event(state->shard, mouse, false);
+      device_close(state->shard, mouse);
+    }
+    unlock_all(ctx);
+  }
+
+  STATS_TIME_ADD(hotplug_ns, start);
+}
+
+static void
+noise_deviation(struct spm_context *ctx, struct device_state *state, int idx)
+{
+  double deviation = fabs(state->noise_mean[idx]) +
+                     NOISE_SIGMAS * sqrt(state->noise_m2[idx]);
+
+  state->deviation[idx] = deviation < ctx->min_deviation ?
+                          ctx->min_deviation :
+                          deviation > MAX_CALIBRATED_DEVIATION ?
+                          MAX_CALIBRATED_DEVIATION : (int)deviation;
+}
+
+/* Collects the noise of the first calibrate motion events with all axes at
+ * rest, then derives the deviations from it and keeps adapting them with the
+ * reports of a device at rest.
+ */
+static void
+calibrate_motion(struct shard *shard, struct device_state *state,
+                 spacemouse_event_t const *mouse_event)
+{
+  struct spm_context *ctx = shard->ctx;
+  int const *axis_array = &mouse_event->motion.x;
+
+  if (state->noise_samples < ctx->config.calibrate) {
+    int n;
+
+    /* not the configured deviation, noisy devices would never calibrate or
+     * have their noise cut off; it is just the lower bound of the result
+     */
+    for (int idx = 0; idx < 6; idx++) {
+      if (abs(axis_array[idx]) > MAX_CALIBRATED_DEVIATION)
+        return;
+    }
+
+    n = ++state->noise_samples;
+
+    for (int idx = 0; idx < 6; idx++) {
+      double delta = axis_array[idx] - state->noise_mean[idx];
+
+      state->noise_mean[idx] += delta / n;
+      state->noise_m2[idx] += delta * (axis_array[idx] -
+                                       state->noise_mean[idx]);
+
+      if (n == ctx->config.calibrate) {
+        state->noise_m2[idx] /= n > 1 ? n - 1 : 1;
+        noise_deviation(ctx, state, idx);
+      }
+    }
+
+    return;
+  }
+
+  for (int idx = 0; idx < 6; idx++) {
+    double sigma = sqrt(state->noise_m2[idx]);
+
+    /* integer values, a noiseless axis still rests within one count */
+    if (fabs(axis_array[idx] - state->noise_mean[idx]) >
+        (sigma < 0.5 ? 1 : REST_SIGMAS * sigma))
+      return;
+  }
+
+  for (int idx = 0; idx < 6; idx++) {
+    double delta = axis_array[idx] - state->noise_mean[idx];
+
+    state->noise_mean[idx] += NOISE_ADAPT_WEIGHT * delta;
+    state->noise_m2[idx] = (1 - NOISE_ADAPT_WEIGHT) *
+                           (state->noise_m2[idx] +
+                            NOISE_ADAPT_WEIGHT * delta * delta /
+                            REST_VARIANCE);
+    noise_deviation(ctx, state, idx);
+  }
+}
+
+/* Only report motion on an axis once its deviation exceeded the minimum
+ * deviation for N consecutive events or for a period of M milliseconds.
+ */
+static void
+filter_motion(struct shard *shard, struct spacemouse *mouse,
+              spacemouse_event_t const *mouse_event)
+{
+  struct spm_config const *config = &shard->ctx->config;
+  struct device_state *state = spacemouse_device_get_data(mouse);
+  int const *axis_array = &mouse_event->motion.x;
+  int const *deviation = state->deviation;
+  int *axis_cond_array = state->axis_cond;
+  bool emitted = false;
+
+  for (int idx = 0; idx < 6; idx++) {
+    int direction = 0;
+
+    if (axis_array[idx] > deviation[idx] && axis_cond_array[idx] >= 0) {
+      if (config->milliseconds != 0) {
+        axis_cond_array[idx] += mouse_event->motion.period;
+
+        if (axis_cond_array[idx] > config->milliseconds) {
+          axis_cond_array[idx] %= config->milliseconds;
+
+          direction = 1;
+        }
+      } else {
+        axis_cond_array[idx] += 1;
+
+        if (axis_cond_array[idx] % config->events == 0)
+          direction = 1;
+      }
+    } else if (axis_array[idx] < -1 * deviation[idx] &&
+               axis_cond_array[idx] <= 0) {
+      if (config->milliseconds != 0) {
+        axis_cond_array[idx] -= mouse_event->motion.period;
+
+        if (axis_cond_array[idx] < -1 * config->milliseconds) {
+          axis_cond_array[idx] %= config->milliseconds;
+          axis_cond_array[idx] *= -1;
+
+          direction = -1;
+        }
+      } else {
+        axis_cond_array[idx] -= 1;
+
+        if (axis_cond_array[idx] % config->events == 0)
+          direction = -1;
+      }
+    } else {
+      axis_cond_array[idx] = 0;
+    }
+
+    if (direction) {
+      spm_event_t event = { .motion = { SPM_EVENT_MOTION, mouse, idx,
+                                        direction } };
+
+      queue_push(shard, &event);
+      emitted = true;
+    }
+  }
+
+  if (!emitted)
+    STATS_INC(events_filtered);
+}
+
+/* zero the axes inside the deadband, skip repeated all zero events */
+static void
+condition_motion(struct shard *shard, struct spacemouse *mouse,
+                 spacemouse_event_t const *mouse_event)
+{
+  struct device_state *state = spacemouse_device_get_data(mouse);
+  int const *axis_array = &mouse_event->motion.x;
+  spm_event_t event = { .raw_motion = { SPM_EVENT_RAW_MOTION, mouse } };
+  bool idle = true;
+
+  for (int idx = 0; idx < 6; idx++) {
+    if (axis_array[idx] > state->deviation[idx] ||
+        axis_array[idx] < -1 * state->deviation[idx]) {
+      event.raw_motion.axis[idx] = axis_array[idx];
+      idle = false;
+    }
+  }
+
+  event.raw_motion.period = mouse_event->motion.period;
+
+  if (!(idle && state->idle))
+    queue_push(shard, &event);
+  else
+    STATS_INC(events_filtered);
+
+  state->idle = idle;
+}
+
+/* When a repeating REL device counts as released. The input core drops
+ * zero valued EV_REL events and evdev the then empty report, so releasing
+ * the cap may produce no report at all.
+ */
+static long long
+release_deadline(struct device_state const *state)
+{
+  return state->last_report + REL_RELEASE_PERIODS * state->report_period;
+}
+
+/* arms the timer for the earliest repeat or REL release of all devices of the
+ * shard
+ */
+static void
+repeat_arm(struct shard *shard)
+{
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  long long next = 0;
+
+  for (struct device_state *state = shard->devices; state;
+       state = state->next) {
+    bool repeating = false;
+
+    for (int idx = 0; idx < 6; idx++) {
+      if (state->repeat_direction[idx] == 0)
+        continue;
+
+      repeating = true;
+      if (next == 0 || state->repeat_deadline[idx] < next)
+        next = state->repeat_deadline[idx];
+    }
+
+    if (repeating && state->relative && release_deadline(state) < next)
+      next = release_deadline(state);
+  }
+
+  /* zero disarms */
+  its.it_value.tv_sec = next / 1000000000;
+  its.it_value.tv_nsec = next % 1000000000;
+
+  timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+motion_event(struct shard *shard, struct spacemouse *mouse, int axis,
+             int direction)
+{
+  spm_event_t event = { .motion = { SPM_EVENT_MOTION, mouse, axis,
+                                    direction } };
+
+  queue_push(shard, &event);
+}
+
+/* Like filter_motion() in milliseconds mode, but driven by the timer: the
+ * first event comes milliseconds after the axis left the deviation, even if
+ * the device does not report in between, then the axis repeats until it
+ * returns inside the deviation.
+ */
+static void
+repeat_motion(struct shard *shard, struct spacemouse *mouse,
+              spacemouse_event_t const *mouse_event)
+{
+  struct spm_config const *config = &shard->ctx->config;
+  struct device_state *state = spacemouse_device_get_data(mouse);
+  int const *axis_array = &mouse_event->motion.x;
+  long long now = now_ns();
+  bool rearm = false;
+
+  if (state->relative) {
+    state->last_report = now;
+    /* longer periods are pauses of the device, not its report rate */
+    if (mouse_event->motion.period > 0 &&
+        mouse_event->motion.period * 1000000LL < state->report_period)
+      state->report_period = mouse_event->motion.period * 1000000LL;
+  }
+
+  for (int idx = 0; idx < 6; idx++) {
+    int direction = axis_array[idx] > state->deviation[idx] ? 1 :
+                    axis_array[idx] < -1 * state->deviation[idx] ? -1 : 0;
+
+    if (direction == state->repeat_direction[idx])
+      continue;
+
+    /* returning inside the deviation or turning around restarts the delay */
+    state->repeat_direction[idx] = direction;
+    if (direction != 0) {
+      state->repeat_delayed[idx] = true;
+      state->repeat_deadline[idx] = now + config->milliseconds * 1000000LL;
+    }
+    rearm = true;
+  }
+
+  /* the events come from the timer */
+  STATS_INC(events_filtered);
+
+  if (rearm)
+    repeat_arm(shard);
+}
+
+static void
+handle_timer(struct shard *shard)
+{
+  struct spm_config const *config = &shard->ctx->config;
+  uint64_t expirations;
+  long long now = now_ns(), min_interval = config->repeat_min * 1000000LL;
+
+  STATS_SYSCALL(SYSCALL_READ);
+  if (read(shard->timer_fd, &expirations, sizeof expirations) == -1)
+    return;
+
+  for (struct device_state *state = shard->devices; state;
+       state = state->next) {
+    bool released = state->relative && release_deadline(state) <= now;
+
+    for (int idx = 0; idx < 6; idx++) {
+      long long *interval = &state->repeat_interval[idx];
+
+      if (released)
+        state->repeat_direction[idx] = 0;
+
+      if (state->repeat_direction[idx] == 0 ||
+          state->repeat_deadline[idx] > now)
+        continue;
+
+      motion_event(shard, state->mouse, idx, state->repeat_direction[idx]);
+
+      if (state->repeat_delayed[idx]) {
+        state->repeat_delayed[idx] = false;
+        *interval = config->repeat * 1000000LL;
+      } else {
+        *interval -= *interval * config->repeat_accel / 100;
+        if (*interval < min_interval)
+          *interval = min_interval;
+      }
+
+      /* keep the cadence, unless we fell behind by more than an interval */
+      state->repeat_deadline[idx] += *interval;
+      if (state->repeat_deadline[idx] <= now)
+        state->repeat_deadline[idx] = now + *interval;
+    }
+  }
+
+  repeat_arm(shard);
+}
+
+static bool
+wanted(struct spm_config const *config, int type)
+{
+  if (config->types == 0)
+    return true;
+
+  switch (type) {
+    case SPACEMOUSE_EVENT_MOTION:
+      return config->types & SPM_TYPE_MOTION;
+
+    case SPACEMOUSE_EVENT_BUTTON:
+      return config->types & SPM_TYPE_BUTTON;
+
+    case SPACEMOUSE_EVENT_LED:
+      return config->types & SPM_TYPE_LED;
+  }
+
+  return false;
+}
+
+static void
+handle_device(struct shard *shard, struct device_state *state)
+{
+  struct spacemouse *mouse = state->mouse;
+  spacemouse_event_t mouse_event = { 0 };
+  spm_event_t event;
+  int status;
+
+  /* closed earlier in the same batch */
+  if (state->closed)
+    return;
+
+  STATS_SYSCALL(SYSCALL_READ);
+  status = spacemouse_device_read_event(mouse, &mouse_event);
+
+  if (status < 0) {
+    device_event(shard, mouse, false);
+    device_close(shard, mouse);
+  } else if (status == SPACEMOUSE_READ_SUCCESS) {
+    STATS_INC(events_read);
+    STATS_DEVICE_EVENT(spacemouse_device_get_id(mouse));
+
+    /* masked in user space, where the kernel could not */
+    if (!wanted(&shard->ctx->config, mouse_event.type)) {
+      STATS_INC(events_filtered);
+    } else if (mouse_event.type == SPACEMOUSE_EVENT_MOTION) {
+      if (shard->ctx->config.calibrate > 0)
+        calibrate_motion(shard, state, &mouse_event);
+
+      if (shard->ctx->config.raw_motion)
+        condition_motion(shard, mouse, &mouse_event);
+      else if (shard->timer_fd > -1)
+        repeat_motion(shard, mouse, &mouse_event);
+      else
+        filter_motion(shard, mouse, &mouse_event);
+    } else if (mouse_event.type == SPACEMOUSE_EVENT_BUTTON) {
+      event.button = (struct spm_event_button){
+        SPM_EVENT_BUTTON, mouse, mouse_event.button.bnum,
+        mouse_event.button.press
+      };
+      queue_push(shard, &event);
+    } else if (mouse_event.type == SPACEMOUSE_EVENT_LED) {
+      event.led = (struct spm_event_led){ SPM_EVENT_LED, mouse,
+                                          mouse_event.led.state };
+      queue_push(shard, &event);
+    }
+  }
+}
+
+/* Signals or clears an eventfd, returns 0 or a negative errno value. EAGAIN
+ * means it already is signalled or clear, which is fine for all of ours.
+ */
+static int
+eventfd_signal(int fd)
+{
+  uint64_t one = 1;
+
+  STATS_SYSCALL(SYSCALL_WRITE);
+  if (write(fd, &one, sizeof one) == -1 && errno != EAGAIN)
+    return -errno;
+
+  return 0;
+}
+
+static int
+eventfd_clear(int fd)
+{
+  uint64_t count;
+
+  STATS_SYSCALL(SYSCALL_READ);
+  if (read(fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    return -errno;
+
+  return 0;
+}
+
+/* handles a ready fd of the shard, returns false for stop_fd */
+static bool
+shard_handle(struct shard *shard, void *ptr)
+{
+  if (ptr == &shard->ctx->stop_fd)
+    return false;
+
+  if (ptr == &shard->timer_fd)
+    handle_timer(shard);
+  else
+    handle_device(shard, ptr);
+
+  return true;
+}
+
+static void *
+shard_run(void *arg)
+{
+  struct shard *shard = arg;
+  struct spm_context *ctx = shard->ctx;
+  bool running = true;
+
+#ifdef SPM_STATS
+  stats_thread_init(shard->name)->cpu = shard->cpu;
+  STATS_SET(shard, true);
+#endif
+
+  while (running) {
+    struct epoll_event ep_events[MAX_BATCH];
+    bool notify;
+    int nready;
+
+    STATS_SYSCALL(SYSCALL_EPOLL_WAIT);
+    nready = epoll_wait(shard->epoll_fd, ep_events, MAX_BATCH, -1);
+
+    if (nready == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    STATS_INC(wakeups);
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* otherwise the merge stage was signalled already */
+    notify = queue_empty(&shard->queue);
+    for (int idx = 0; idx < nready; idx++)
+      running = shard_handle(shard, ep_events[idx].data.ptr) && running;
+    shard_reap(shard);
+    notify = notify && !queue_empty(&shard->queue);
+
+    STATS_SET(open_devices, shard->ndevices);
+
+    /* wake_fd is ours and not closed before the thread is joined */
+    if (notify)
+      eventfd_signal(ctx->wake_fd);
+
+    /* stop reading while the application falls behind */
+    while (shard->queue.len - shard->queue.head > MAX_SHARD_QUEUE &&
+           !shard->stopping)
+      pthread_cond_wait(&shard->merged, &shard->lock);
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return NULL;
+}
+
+static int
+shard_init(struct spm_context *ctx, struct shard *shard, int idx)
+{
+  struct epoll_event ep_event = { .events = EPOLLIN };
+
+  shard->ctx = ctx;
+  shard->timer_fd = -1;
+  snprintf(shard->name, sizeof shard->name, "shard %d", idx);
+  pthread_mutex_init(&shard->lock, NULL);
+  pthread_cond_init(&shard->merged, NULL);
+
+  if (!ctx->threaded) {
+    shard->epoll_fd = ctx->epoll_fd;
+  } else {
+    if ((shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      return -errno;
+
+    ep_event.data.ptr = &ctx->stop_fd;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, ctx->stop_fd, &ep_event)
+        == -1)
+      return -errno;
+  }
+
+  if (ctx->config.repeat > 0 && ctx->config.milliseconds > 0 &&
+      !ctx->config.raw_motion) {
+    ep_event.data.ptr = &shard->timer_fd;
+
+    if ((shard->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_NONBLOCK | TFD_CLOEXEC)) == -1 ||
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->timer_fd, &ep_event)
+        == -1)
+      return -errno;
+  }
+
+  return 0;
+}
+
+/* Checks that every worker's CPU is online and allowed for the process. */
+static int
+check_cpus(int const *cpus, int nshards)
+{
+  cpu_set_t allowed;
+
+  if (sched_getaffinity(0, sizeof allowed, &allowed) == -1)
+    return -errno;
+
+  for (int idx = 0; idx < nshards; idx++) {
+    if (cpus[idx] > -1 &&
+        (cpus[idx] >= CPU_SETSIZE || !CPU_ISSET(cpus[idx], &allowed)))
+      return -ENXIO;
+  }
+
+  return 0;
+}
+
+static int
+shard_start(struct shard *shard)
+{
+  pthread_attr_t attr;
+  sigset_t all, old;
+  int err;
+
+  pthread_attr_init(&attr);
+
+  /* signals are for the application's thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  if (shard->cpu > -1) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+
+    if ((err = pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus)) != 0)
+      goto out;
+  }
+
+  if ((err = pthread_create(&shard->thread, &attr, shard_run, shard)) == 0)
+    shard->started = true;
+  else if (err == EINVAL && shard->cpu > -1)
+    err = ENXIO; /* the CPU went offline since check_cpus() */
+
+out:
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  return -err;
+}
+
+static void
+shard_free(struct shard *shard)
+{
+  struct spm_context *ctx = shard->ctx;
+
+  if (ctx == NULL)
+    return;
+
+  while (shard->devices != NULL)
+    device_close(shard, shard->devices->mouse);
+  shard_reap(shard);
+
+  if (shard->timer_fd > -1)
+    close(shard->timer_fd);
+  if (ctx->threaded && shard->epoll_fd > -1)
+    close(shard->epoll_fd);
+
+  pthread_mutex_destroy(&shard->lock);
+  pthread_cond_destroy(&shard->merged);
+  free(shard->queue.events);
+}
+
+/* Moves the events of all shards to the merged queue, by time if ordered.
+ * Returns -ENOMEM if the merged queue cannot grow, the events left stay in
+ * their shards for the next call.
+ */
+static int
+merge(struct spm_context *ctx)
+{
+  int err;
+
+  if ((err = eventfd_clear(ctx->wake_fd)) < 0)
+    return err;
+
+  lock_all(ctx);
+
+  for (;;) {
+    struct queue *next = NULL;
+
+    for (int idx = 0; idx < ctx->nshards; idx++) {
+      struct queue *queue = &ctx->shards[idx].queue;
+
+      if (queue_empty(queue))
+        continue;
+
+      if (!ctx->config.ordered) {
+        next = queue;
+        break;
+      }
+
+      if (next == NULL ||
+          queue->events[queue->head].time < next->events[next->head].time)
+        next = queue;
+    }
+
+    if (next == NULL)
+      break;
+
+    do {
+      if ((err = queue_append(&ctx->merged, &next->events[next->head])) < 0)
+        break;
+      next->head++;
+    } while (!ctx->config.ordered && !queue_empty(next));
+
+    if (err < 0)
+      break;
+  }
+
+  for (int idx = 0; idx < ctx->nshards; idx++) {
+    struct queue *queue = &ctx->shards[idx].queue;
+
+    if (queue_empty(queue))
+      queue->head = queue->len = 0;
+    pthread_cond_signal(&ctx->shards[idx].merged);
+  }
+
+  unlock_all(ctx);
+
+  /* the workers only signal when their queue was empty, retry from here */
+  if (err < 0)
+    eventfd_signal(ctx->wake_fd);
+
+  return err;
+}
+
+/* Keeps pending_fd, and so the epoll fd, readable while out is not empty.
+ * On failure nothing changes, so the next call tries again.
+ */
+static int
+update_pending(struct spm_context *ctx, struct queue const *out)
+{
+  int err;
+
+  if (queue_empty(out) != ctx->pending)
+    return 0;
+
+  if (ctx->pending)
+    err = eventfd_clear(ctx->pending_fd);
+  else
+    err = eventfd_signal(ctx->pending_fd);
+
+  if (err < 0)
+    return err;
+
+  ctx->pending = !ctx->pending;
+
+  return 0;
+}
+
+int
+spm_new(struct spm_config const *config, struct spm_context **ctx_ret)
+{
+  struct spm_context *ctx;
+  struct spacemouse *head, *iter;
+  struct epoll_event ep_event = { .events = EPOLLIN, .data.ptr = NULL };
+  char const *re_strs[] = { config->match.devnode,
+                            config->match.manufacturer,
+                            config->match.product };
+  int err, cflags = REG_EXTENDED | REG_NOSUB |
+                    (config->match.ignore_case ? REG_ICASE : 0);
+
+  if ((ctx = calloc(1, sizeof *ctx)) == NULL)
+    return -ENOMEM;
+
+  ctx->config = *config;
+  ctx->epoll_fd = ctx->monitor_fd = ctx->wake_fd = ctx->stop_fd = -1;
+  ctx->pending_fd = -1;
+
+  ctx->min_deviation = ctx->config.deviation ? ctx->config.deviation :
+                                               MIN_CALIBRATED_DEVIATION;
+
+  if (ctx->config.deviation == 0 && !ctx->config.raw_motion)
+    ctx->config.deviation = SPM_MIN_DEVIATION;
+  if (ctx->config.events == 0 && ctx->config.milliseconds == 0)
+    ctx->config.events = SPM_N_EVENTS;
+  if (ctx->config.repeat_min == 0)
+    ctx->config.repeat_min = SPM_MIN_REPEAT;
+  if (ctx->config.repeat_min > ctx->config.repeat)
+    ctx->config.repeat_min = ctx->config.repeat;
+
+  ctx->threaded = ctx->config.threads > 0;
+  ctx->nshards = ctx->threaded ? ctx->config.threads : 1;
+
+  if (ctx->threaded && config->cpus != NULL &&
+      (err = check_cpus(config->cpus, ctx->nshards)) < 0)
+    goto error;
+
+  for (size_t idx = 0; idx < 3; idx++) {
+    if (re_strs[idx] == NULL)
+      continue;
+
+    if (regcomp(&ctx->regex[idx], re_strs[idx], cflags) != 0) {
+      err = -EINVAL;
+      goto error;
+    }
+    ctx->has_regex[idx] = true;
+  }
+
+  if ((ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    err = -errno;
+    goto error;
+  }
+
+  ep_event.data.ptr = &ctx->pending_fd;
+
+  if ((ctx->pending_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+      epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->pending_fd, &ep_event)
+      == -1) {
+    err = -errno;
+    goto error;
+  }
+
+  if (ctx->threaded) {
+    ep_event.data.ptr = &ctx->wake_fd;
+
+    if ((ctx->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        (ctx->stop_fd = eventfd(0, EFD_CLOEXEC)) == -1 ||
+        epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->wake_fd, &ep_event)
+        == -1) {
+      err = -errno;
+      goto error;
+    }
+  }
+
+  if ((ctx->shards = calloc(ctx->nshards, sizeof *ctx->shards)) == NULL) {
+    err = -ENOMEM;
+    goto error;
+  }
+
+  for (int idx = 0; idx < ctx->nshards; idx++) {
+    struct shard *shard = &ctx->shards[idx];
+
+    if ((err = shard_init(ctx, shard, idx)) < 0)
+      goto error;
+
+    shard->cpu = config->cpus != NULL ? config->cpus[idx] : -1;
+  }
+
+  /* The monitor is opened before listing and only read by spm_dispatch(),
+   * so devices connected meanwhile wait in it instead of being missed.
+   */
+  if ((ctx->monitor_fd = spacemouse_monitor_open()) < 0) {
+    err = ctx->monitor_fd;
+    goto error;
+  }
+
+  ep_event.data.ptr = NULL;
+  if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->monitor_fd, &ep_event)
+      == -1) {
+    err = -errno;
+    goto error;
+  }
+
+  {
+    STATS_TIME_START(start);
+
+    if ((err = spacemouse_device_list(&head, 1)) != 0) {
+      err = err < 0 ? err : -EIO;
+      goto error;
+    }
+
+    spacemouse_device_list_foreach(iter, head) {
+      struct shard *shard = least_loaded(ctx);
+
+      if (device_init(shard, iter) && ctx->config.report_present)
+        device_event(shard, iter, true);
+    }
+
+    STATS_TIME_ADD(enumeration_ns, start);
+  }
+
+  if (ctx->threaded) {
+    for (int idx = 0; idx < ctx->nshards; idx++) {
+      if ((err = shard_start(&ctx->shards[idx])) < 0)
+        goto error;
+    }
+
+    /* deliver the events of the enumeration */
+    if ((err = eventfd_signal(ctx->wake_fd)) < 0)
+      goto error;
+  } else if ((err = update_pending(ctx, &ctx->shards[0].queue)) < 0) {
+    goto error;
+  }
+
+  *ctx_ret = ctx;
+
+  return 0;
+
+error:
+  spm_free(ctx);
+
+  return err;
+}
+
+void
+spm_free(struct spm_context *ctx)
+{
+  if (ctx->threaded && ctx->stop_fd > -1)
+    eventfd_signal(ctx->stop_fd);
+
+  for (int idx = 0; ctx->shards != NULL && idx < ctx->nshards; idx++) {
+    struct shard *shard = &ctx->shards[idx];
+
+    if (!shard->started)
+      continue;
+
+    pthread_mutex_lock(&shard->lock);
+    shard->stopping = true;
+    pthread_cond_signal(&shard->merged);
+    pthread_mutex_unlock(&shard->lock);
+
+    pthread_join(shard->thread, NULL);
+  }
+
+  for (int idx = 0; ctx->shards != NULL && idx < ctx->nshards; idx++)
+    shard_free(&ctx->shards[idx]);
+
+  for (size_t idx = 0; idx < 3; idx++) {
+    if (ctx->has_regex[idx])
+      regfree(&ctx->regex[idx]);
+  }
+
+  if (ctx->wake_fd > -1)
+    close(ctx->wake_fd);
+  if (ctx->stop_fd > -1)
+    close(ctx->stop_fd);
+  if (ctx->pending_fd > -1)
+    close(ctx->pending_fd);
+  if (ctx->epoll_fd > -1)
+    close(ctx->epoll_fd);
+
+  free(ctx->shards);
+  free(ctx->merged.events);
+  free(ctx);
+}
+
+int
+spm_get_fd(struct spm_context *ctx)
+{
+  return ctx->epoll_fd;
+}
+
+void
+spm_set_callback(struct spm_context *ctx, spm_callback_t callback, void *data)
+{
+  ctx->callback = callback;
+  ctx->callback_data = data;
+}
+
+int
+spm_dispatch(struct spm_context *ctx, spm_event_t *events, int max_events,
+             int timeout)
+{
+  struct queue *out = ctx->threaded ? &ctx->merged : &ctx->shards[0].queue;
+  int delivered = 0, err = 0, ret;
+
+  /* Only poll for new work once everything queued is delivered, events of
+   * removed devices stay valid until then.
+   */
+  if (queue_empty(out)) {
+    struct epoll_event ep_events[MAX_BATCH];
+    int nready;
+
+    out->head = out->len = 0;
+
+    STATS_SYSCALL(SYSCALL_EPOLL_WAIT);
+    nready = epoll_wait(ctx->epoll_fd, ep_events, MAX_BATCH, timeout);
+
+    if (nready == -1)
+      return errno == EINTR ? 0 : -errno;
+
+    for (int idx = 0; idx < nready; idx++) {
+      if (ep_events[idx].data.ptr == NULL)
+        handle_monitor(ctx);
+      else if (ep_events[idx].data.ptr != &ctx->wake_fd &&
+               ep_events[idx].data.ptr != &ctx->pending_fd)
+        shard_handle(&ctx->shards[0], ep_events[idx].data.ptr);
+    }
+
+    /* the monitor queues into the shards of the workers as well */
+    if (ctx->threaded && nready > 0)
+      err = merge(ctx);
+    else if (!ctx->threaded)
+      shard_reap(&ctx->shards[0]);
+  }
+
+  while (!queue_empty(out) && delivered < max_events) {
+    spm_event_t *event = &out->events[out->head++].event;
+
+    if (events != NULL)
+      events[delivered] = *event;
+    else if (ctx->callback != NULL)
+      ctx->callback(event, ctx->callback_data);
+
+    delivered++;
+  }
+
+  if ((ret = update_pending(ctx, out)) < 0 && err == 0)
+    err = ret;
+
+  /* what failed is retried by the next call, report it once it held up
+   * the delivery
+   */
+  return delivered > 0 ? delivered : err;
+}
+
+void *
+spm_device_get_data(struct spacemouse *mouse)
+{
+  struct device_state *state = spacemouse_device_get_data(mouse);
+
+  return state != NULL ? state->data : NULL;
+}
+
+void
+spm_device_set_data(struct spacemouse *mouse, void *data)
+{
+  struct device_state *state = spacemouse_device_get_data(mouse);
+
+  if (state != NULL)
+    state->data = data;
+}
+
+char const *
+spm_motion_str(int axis, int direction)
+{
+  if (axis < 0 || axis >= 6)
+    return NULL;
+
+  return axis_str[axis][direction < 0];
+}
+
+int
+spm_event_format(spm_event_t const *event, char *buf, size_t size)
+{
+  struct spacemouse *mouse = event->any.mouse;
+
+  switch (event->type) {
+    case SPM_EVENT_DEVICE:
+      return snprintf(buf, size, "device: %s %s %s %s\n",
+                      spacemouse_device_get_devnode(mouse),
+                      spacemouse_device_get_manufacturer(mouse),
+                      spacemouse_device_get_product(mouse),
+                      event->device.connect ? "connect" : "disconnect");
+
+    case SPM_EVENT_MOTION:
+      return snprintf(buf, size, "motion: %s\n",
+                      spm_motion_str(event->motion.axis,
+                                     event->motion.direction));
+
+    case SPM_EVENT_RAW_MOTION:
+      return snprintf(buf, size, "motion: t(%d, %d, %d) r(%d, %d, %d) "
+                      "period(%d)\n", event->raw_motion.axis[0],
+                      event->raw_motion.axis[1], event->raw_motion.axis[2],
+                      event->raw_motion.axis[3], event->raw_motion.axis[4],
+                      event->raw_motion.axis[5], event->raw_motion.period);
+
+    case SPM_EVENT_BUTTON:
+      return snprintf(buf, size, "button: %d %s\n", event->button.bnum,
+                      event->button.press ? "press" : "release");
+
+    case SPM_EVENT_LED:
+      return snprintf(buf, size, "led: %s\n", event->led.state ? "on" : "off");
+
+    case SPM_EVENT_ERROR:
+      return snprintf(buf, size, "error: failed to %s device '%s': %s\n",
+                      event->error.operation,
+                      spacemouse_device_get_devnode(mouse),
+                      strerror(-event->error.error));
+  }
+
+  return snprintf(buf, size, "%s", "");
+}
@@ -0,0 +1,213 @@
+#ifndef _SPM_HDR_
+#define _SPM_HDR_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <libspacemouse.h>
+
+/* libspm: the 'spm event' pipeline (device matching, deviation threshold
+ * filter and hotplug handling) as an embeddable library.
+ *
+ * Functions returning an int return a negative errno value on failure, like
+ * libspacemouse does.
+ */
+
+#define SPM_MIN_DEVIATION 256
+#define SPM_N_EVENTS 16
+#define SPM_MIN_REPEAT 20
+#define SPM_CALIBRATE_EVENTS 64
+
+/* spm_config.types */
+#define SPM_TYPE_MOTION (1 << 0)
+#define SPM_TYPE_BUTTON (1 << 1)
+#define SPM_TYPE_LED (1 << 2)
+#define SPM_TYPE_DEVICE (1 << 3)
+
+struct spm_context;
+
+/* regular expressions (ERE) the device strings must match, NULL matches all */
+struct spm_match {
+  bool ignore_case;
+
+  char const *devnode, *manufacturer, *product;
+};
+
+/* mirrors the event command options of spm, zero selects the default */
+struct spm_config {
+  struct spm_match match;
+
+  bool grab;
+
+  int deviation;
+  int events;
+  int milliseconds;
+
+  /* Deliver SPM_EVENT_RAW_MOTION events with the axis values inside the
+   * deviation zeroed instead of SPM_EVENT_MOTION events. Zero deviation means
+   * no deadband in this mode.
+   */
+  bool raw_motion;
+  /* report devices already connected at spm_new() as connect events */
+  bool report_present;
+
+  /* With milliseconds set, emit a motion event from a timer milliseconds
+   * after the axis left the deviation and repeat it every repeat
+   * milliseconds for as long as the axis stays outside, even when the device
+   * stops reporting. Each repeat shortens the interval by repeat_accel
+   * percent, down to repeat_min milliseconds (SPM_MIN_REPEAT by default).
+   */
+  int repeat;
+  int repeat_min;
+  int repeat_accel;
+
+  /* Shard the devices across threads worker threads, each with its own epoll
+   * set, filter state and event queue, which spm_dispatch() merges. Hotplugged
+   * devices go to the shard with the fewest devices. Zero handles everything
+   * in spm_dispatch(). cpus optionally holds the CPU to pin each worker to, -1
+   * for none, and is only read by spm_new().
+   */
+  int threads;
+  int const *cpus;
+  /* merge the events of all shards in the order they were read */
+  bool ordered;
+
+  /* Calibrate a deviation per device and axis from the noise of the first
+   * calibrate motion events at rest after the device connects, and keep
+   * adapting it slowly while the axis is idle. Until then the deviation is
+   * used, afterwards a non-zero deviation is the lower bound.
+   */
+  int calibrate;
+
+  /* SPM_TYPE_* of the events to deliver, zero for all. Device events are
+   * always delivered, SPM_TYPE_DEVICE alone selects only them. The other
+   * types are masked in the kernel with EVIOCSMASK, so they do not wake up
+   * the context, or dropped after reading on kernels without it.
+   */
+  unsigned types;
+
+  /* Devices whose evdev phys, as set by UI_SET_PHYS for uinput devices, is
+   * exclude_phys are never opened, so spm proxy does not read its own
+   * virtual devices.
+   */
+  char const *exclude_phys;
+};
+
+enum {
+  SPM_EVENT_ERROR,
+  SPM_EVENT_DEVICE,
+  SPM_EVENT_MOTION,
+  SPM_EVENT_RAW_MOTION,
+  SPM_EVENT_BUTTON,
+  SPM_EVENT_LED
+};
+
+/* Every event carries the device it originated from. The device pointer is
+ * valid until the next call to spm_dispatch().
+ */
+typedef union spm_event {
+  int type;
+
+  struct spm_event_any {
+    int type;
+    struct spacemouse *mouse;
+  } any;
+
+  struct spm_event_error {
+    int type;
+    struct spacemouse *mouse;
+    char const *operation; /* "open" or "grab" */
+    int error; /* negative errno value */
+  } error;
+
+  struct spm_event_device {
+    int type;
+    struct spacemouse *mouse;
+    bool connect;
+    void *data; /* spm_device_get_data(), the device is gone on disconnect */
+  } device;
+
+  struct spm_event_motion {
+    int type;
+    struct spacemouse *mouse;
+    int axis; /* 0 to 5: x, y, z, rx, ry, rz */
+    int direction; /* 1 or -1 */
+  } motion;
+
+  struct spm_event_raw_motion {
+    int type;
+    struct spacemouse *mouse;
+    int axis[6];
+    int period;
+  } raw_motion;
+
+  struct spm_event_button {
+    int type;
+    struct spacemouse *mouse;
+    int bnum;
+    bool press;
+  } button;
+
+  struct spm_event_led {
+    int type;
+    struct spacemouse *mouse;
+    bool state;
+  } led;
+} spm_event_t;
+
+typedef void (*spm_callback_t)(spm_event_t const *event, void *data);
+
+/* Compiles the match regexes, opens the monitor and all matching devices.
+ * Returns -EINVAL if one of the regexes is not a valid ERE, -ENXIO if one of
+ * the CPUs to pin the workers to is offline or not allowed for the process.
+ */
+int
+spm_new(struct spm_config const *config, struct spm_context **ctx);
+
+/* Closes all devices opened by the context and frees it. */
+void
+spm_free(struct spm_context *ctx);
+
+/* File descriptor which becomes readable when spm_dispatch() has work to do,
+ * suitable for adding to the event loop of an application. It stays readable
+ * while events are left over from a call with a small max_events.
+ */
+int
+spm_get_fd(struct spm_context *ctx);
+
+/* Callback used by spm_dispatch() when called without an events array. */
+void
+spm_set_callback(struct spm_context *ctx, spm_callback_t callback, void *data);
+
+/* Waits at most timeout milliseconds (-1 for infinite) for the fd to become
+ * readable, handles all ready devices and the monitor in one batch and
+ * delivers up to max_events events, either by storing them in events or, if
+ * events is NULL, by passing them to the callback. Events not delivered are
+ * kept for the next call.
+ *
+ * Returns the number of events delivered, which may be 0 if everything read
+ * was filtered out, or a negative errno value, -ENOMEM if the events read
+ * could not be queued. Nothing is lost on errors, the next call retries.
+ */
+int
+spm_dispatch(struct spm_context *ctx, spm_event_t *events, int max_events,
+             int timeout);
+
+/* Application data attached to a device opened by the context. */
+void *
+spm_device_get_data(struct spacemouse *mouse);
+
+void
+spm_device_set_data(struct spacemouse *mouse, void *data);
+
+/* Name of the motion event, e.g. "forward" or "yaw left". */
+char const *
+spm_motion_str(int axis, int direction);
+
+/* Formats an event the way 'spm event' prints it, including the newline.
+ * Returns the length like snprintf().
+ */
+int
+spm_event_format(spm_event_t const *event, char *buf, size_t size);
+
+#endif /* #ifndef _SPM_HDR_ */
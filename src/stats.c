@@ -0,0 +1,168 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#ifdef SPM_STATS
+
+#include <pthread.h>
+
+__thread struct stats *thread_stats;
+
+static struct stats *all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static char const *syscall_names[N_SYSCALLS] = {
+  "poll", "select", "epoll_wait", "read", "write", "send", "ioctl"
+};
+
+struct stats *
+stats_thread_init(char const *name)
+{
+  struct stats *stats = calloc(1, sizeof *stats);
+
+  /* counting is best effort, an unregistered thread counts into a dummy */
+  if (stats == NULL) {
+    static __thread struct stats dummy;
+
+    return thread_stats = &dummy;
+  }
+
+  stats->name = name;
+
+  pthread_mutex_lock(&all_stats_lock);
+  stats->next = all_stats;
+  all_stats = stats;
+  pthread_mutex_unlock(&all_stats_lock);
+
+  return thread_stats = stats;
+}
+
+void
+stats_device_event(struct stats *stats, int id)
+{
+  size_t idx;
+
+  for (idx = 0; idx < STATS_MAX_DEVICES - 1; idx++) {
+    if (stats->devices[idx].events == 0)
+      stats->devices[idx].id = id;
+
+    if (stats->devices[idx].id == id)
+      break;
+  }
+
+  stats->devices[idx].events++;
+}
+
+void
+stats_dump(int fd)
+{
+  struct rusage usage = { 0 };
+  int nthreads = 0;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  pthread_mutex_lock(&all_stats_lock);
+
+  for (struct stats *stats = all_stats; stats != NULL; stats = stats->next)
+    nthreads++;
+
+  dprintf(fd, "stats: %d threads, cpu time (us): user %lld, system %lld\n",
+          nthreads,
+          usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec,
+          usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec);
+
+  for (struct stats *stats = all_stats; stats != NULL; stats = stats->next) {
+    dprintf(fd, "stats: thread %s\n", stats->name);
+
+    if (stats->shard) {
+      if (stats->cpu > -1)
+        dprintf(fd, "  pinned to cpu %d\n", stats->cpu);
+      dprintf(fd, "  open devices: %llu\n", stats->open_devices);
+    }
+
+    dprintf(fd, "  wakeups: %llu\n"
+                "  syscalls:", stats->wakeups);
+
+    for (int idx = 0; idx < N_SYSCALLS; idx++)
+      dprintf(fd, "%s %s %llu", idx ? "," : "", syscall_names[idx],
+              stats->syscalls[idx]);
+
+    dprintf(fd, "\n"
+                "  events: read %llu, filtered %llu, emitted %llu\n"
+                "  bytes written: %llu\n"
+                "  time (us): format %llu, output %llu, enumeration %llu, "
+                "hotplug %llu\n",
+            stats->events_read, stats->events_filtered, stats->events_emitted,
+            stats->bytes_written, stats->format_ns / 1000,
+            stats->output_ns / 1000, stats->enumeration_ns / 1000,
+            stats->hotplug_ns / 1000);
+
+    if (stats->masks_kernel != 0 || stats->masks_user != 0)
+      dprintf(fd, "  event masks: kernel %llu, user space %llu\n",
+              stats->masks_kernel, stats->masks_user);
+
+    for (int idx = 0; idx < STATS_MAX_DEVICES; idx++) {
+      if (stats->devices[idx].events == 0)
+        continue;
+
+      if (idx == STATS_MAX_DEVICES - 1)
+        dprintf(fd, "  other devices: %llu events\n",
+                stats->devices[idx].events);
+      else
+        dprintf(fd, "  device id %d: %llu events\n", stats->devices[idx].id,
+                stats->devices[idx].events);
+    }
+  }
+
+  pthread_mutex_unlock(&all_stats_lock);
+}
+
+static void
+request_dump(int signum)
+{
+  dump_requested = 1;
+}
+
+void
+stats_install_signal(void)
+{
+  /* no SA_RESTART, so a blocking poll() or select() returns to dump */
+  struct sigaction action = { .sa_handler = request_dump };
+
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+void
+stats_poll(int fd)
+{
+  if (dump_requested) {
+    dump_requested = 0;
+    stats_dump(fd);
+  }
+}
+
+#else /* #ifdef SPM_STATS */
+
+void
+stats_dump(int fd)
+{
+}
+
+void
+stats_install_signal(void)
+{
+}
+
+void
+stats_poll(int fd)
+{
+}
+
+#endif /* #ifdef SPM_STATS */
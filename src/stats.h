@@ -0,0 +1,120 @@
+#ifndef _STATS_HDR_
+#define _STATS_HDR_
+
+/* Hot path counters, compiled in with 'make STATS=1' (-DSPM_STATS). Without
+ * it every STATS_* macro expands to nothing and costs nothing.
+ *
+ * Each thread counts into its own struct stats, all of them are printed by
+ * stats_dump().
+ */
+
+#include <stdbool.h>
+
+#define STATS_MAX_DEVICES 32
+
+typedef enum {
+  SYSCALL_POLL,
+  SYSCALL_SELECT,
+  SYSCALL_EPOLL_WAIT,
+  SYSCALL_READ,
+  SYSCALL_WRITE,
+  SYSCALL_SEND,
+  SYSCALL_IOCTL,
+  N_SYSCALLS
+} syscall_t;
+
+struct stats {
+  char const *name;
+
+  /* worker threads of a sharded spm context */
+  bool shard;
+  int cpu; /* -1 when not pinned */
+  unsigned long long open_devices;
+
+  unsigned long long wakeups;
+  unsigned long long syscalls[N_SYSCALLS];
+
+  /* events read from devices, dropped by the filter, emitted as output */
+  unsigned long long events_read, events_filtered, events_emitted;
+  /* devices whose unwanted event types are masked by the kernel or not */
+  unsigned long long masks_kernel, masks_user;
+  unsigned long long bytes_written;
+
+  /* nanoseconds */
+  unsigned long long format_ns, output_ns, enumeration_ns, hotplug_ns;
+
+  /* events read per device id, the last slot counts all other devices */
+  struct {
+    int id;
+    unsigned long long events;
+  } devices[STATS_MAX_DEVICES];
+
+  struct stats *next;
+};
+
+#ifdef SPM_STATS
+
+#include <time.h>
+
+extern __thread struct stats *thread_stats;
+
+/* registers the calling thread's counters under name */
+struct stats *
+stats_thread_init(char const *name);
+
+void
+stats_device_event(struct stats *stats, int id);
+
+static inline struct stats *
+stats_local(void)
+{
+  return thread_stats ? thread_stats : stats_thread_init("main");
+}
+
+static inline unsigned long long
+stats_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define STATS_SET(field, n) (stats_local()->field = (n))
+#define STATS_ADD(field, n) (stats_local()->field += (n))
+#define STATS_INC(field) STATS_ADD(field, 1)
+#define STATS_SYSCALL(syscall) STATS_INC(syscalls[syscall])
+#define STATS_DEVICE_EVENT(id) stats_device_event(stats_local(), (id))
+#define STATS_TIME_START(var) unsigned long long var = stats_now_ns()
+#define STATS_TIME_ADD(field, var) STATS_ADD(field, stats_now_ns() - (var))
+
+#else /* #ifdef SPM_STATS */
+
+#define STATS_SET(field, n) ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_INC(field) ((void)0)
+#define STATS_SYSCALL(syscall) ((void)0)
+#define STATS_DEVICE_EVENT(id) ((void)0)
+#define STATS_TIME_START(var)
+#define STATS_TIME_ADD(field, var) ((void)0)
+
+#endif /* #ifdef SPM_STATS */
+
+/* Prints the counters of all threads to fd, does nothing without
+ * SPM_STATS.
+ */
+void
+stats_dump(int fd);
+
+/* Makes SIGUSR1 request a dump from stats_poll(), interrupting blocking
+ * calls. Without SPM_STATS it does nothing and SIGUSR1 keeps terminating spm.
+ */
+void
+stats_install_signal(void);
+
+/* Dumps the counters to fd if SIGUSR1 requested it since the last call. */
+void
+stats_poll(int fd);
+
+#endif /* #ifndef _STATS_HDR_ */
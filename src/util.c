@@ -1,9 +1,11 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <stdarg.h>
 #include <regex.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -18,12 +20,25 @@ warn(char const *format, ...)
     va_end(ap);
 }
 
+static struct {
+  jmp_buf *env;
+  char *buf;
+  size_t size;
+} fail_jump;
+
 void
 fail(char const *format, ...)
 {
     va_list ap;
     va_start(ap, format);
 
+    if (fail_jump.env != NULL) {
+      vsnprintf(fail_jump.buf, fail_jump.size, format, ap);
+      va_end(ap);
+
+      longjmp(*fail_jump.env, 1);
+    }
+
     vfprintf(stderr, format, ap);
 
     va_end(ap);
@@ -31,20 +46,49 @@ fail(char const *format, ...)
     exit(EXIT_FAILURE);
 }
 
-static int
-run_regex(char const *regex, char const *string, bool ignore_case)
+void
+fail_catch(jmp_buf *env, char *buf, size_t size)
 {
+  fail_jump.env = env;
+  fail_jump.buf = buf;
+  fail_jump.size = size;
+}
+
+/* the patterns rarely change during a run, so each of the three members
+ * keeps its last compiled pattern instead of compiling it for every device
+ */
+static struct {
+  char *pattern;
+  bool ignore_case;
   regex_t preg;
-  int ret, cflags = REG_EXTENDED | REG_NOSUB | (ignore_case ? REG_ICASE : 0);
+} regex_cache[3];
 
-  if (regcomp(&preg, regex, cflags) != 0)
-    return -1;
+static int
+run_regex(size_t member, char const *regex, char const *string,
+          bool ignore_case)
+{
+  int cflags = REG_EXTENDED | REG_NOSUB | (ignore_case ? REG_ICASE : 0);
+  char *pattern = regex_cache[member].pattern;
+
+  if (pattern == NULL || strcmp(pattern, regex) != 0 ||
+      regex_cache[member].ignore_case != ignore_case) {
+    if (pattern != NULL) {
+      regfree(&regex_cache[member].preg);
+      free(pattern);
+      regex_cache[member].pattern = NULL;
+    }
 
-  ret = regexec(&preg, string, 0, NULL, 0);
+    if (regcomp(&regex_cache[member].preg, regex, cflags) != 0)
+      return -1;
 
-  regfree(&preg);
+    if ((regex_cache[member].pattern = strdup(regex)) == NULL) {
+      regfree(&regex_cache[member].preg);
+      return -1;
+    }
+    regex_cache[member].ignore_case = ignore_case;
+  }
 
-  return ret;
+  return regexec(&regex_cache[member].preg, string, 0, NULL, 0);
 }
 
 int
@@ -59,7 +103,7 @@ match_device(struct spacemouse *mouse, match_t const *match_opts)
 
   for (size_t idx = 0; idx < 3; idx++) {
     if (re_strs[idx] != NULL) {
-      int regex_success = run_regex(re_strs[idx], members[idx],
+      int regex_success = run_regex(idx, re_strs[idx], members[idx],
                                     match_opts->ignore_case);
       if (regex_success == -1) {
         return -1;
@@ -70,3 +114,23 @@ match_device(struct spacemouse *mouse, match_t const *match_opts)
 
   return !match;
 }
+
+long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long
+now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
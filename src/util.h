@@ -1,6 +1,8 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <setjmp.h>
+
 #include <libspacemouse.h>
 
 #include "options.h"
@@ -21,7 +23,22 @@ warn(char const *format, ...);
 void
 fail(char const *format, ...);
 
+/* While env is set, fail() stores its message in buf and longjmp()s to env
+ * instead of exiting, so the batch command can reuse the command line
+ * parsers. NULL restores exiting.
+ */
+void
+fail_catch(jmp_buf *env, char *buf, size_t size);
+
 int
 match_device(struct spacemouse *mouse, struct match const *match_opts);
 
+/* milliseconds of the monotonic clock */
+long long
+now_ms(void);
+
+/* microseconds of the monotonic clock */
+long long
+now_us(void);
+
 #endif /* #ifndef _UTIL_H_ */